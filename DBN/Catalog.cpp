@@ -0,0 +1,211 @@
+//
+//  Catalog.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include "Catalog.h"
+#include "Context.h"
+#include "IO.h"
+#include "SupportFunctions.h"
+#include "Quantize.h"
+#include <string.h>
+
+Data_Catalog::Data_Catalog(Context *c){
+   context = (c == NULL) ? Context::default_context() : c;
+   bits = 0;
+}
+
+bool Data_Catalog::load(const std::string& filename){
+   std::ifstream file(filename.c_str());
+   if (!file.is_open()) {
+      std::cerr << "Could not open file: " << filename << std::endl;
+      return false;
+   }
+   
+   std::string line;
+   int number = 0;
+   while (getline(file, line)) {
+      ++number;
+      if (line.empty() || line[0] == '#') continue;
+      std::istringstream iss(line);
+      Catalog_Entry entry;
+      if (!(iss >> entry.subject >> entry.session >> entry.source >> entry.cachefile >> entry.dims[0] >> entry.dims[1] >> entry.dims[2] >> entry.scans >> entry.maskfile)) {
+         std::cerr << filename << ":" << number << ": expected subject session source cachefile x y z scans maskfile" << std::endl;
+         return false;
+      }
+      if (entry.maskfile == "-") entry.maskfile = "";
+      entries.push_back(entry);
+   }
+   return true;
+}
+
+bool Data_Catalog::save(const std::string& filename){
+   std::ofstream file(filename.c_str());
+   if (!file.is_open()) {
+      std::cerr << "Could not open file: " << filename << std::endl;
+      return false;
+   }
+   file << "# subject session source cachefile x y z scans maskfile" << std::endl;
+   for (auto entry:entries)
+      file << entry.subject << " " << entry.session << " " << entry.source << " " << entry.cachefile << " "
+           << entry.dims[0] << " " << entry.dims[1] << " " << entry.dims[2] << " " << entry.scans << " "
+           << (entry.maskfile.empty() ? "-" : entry.maskfile) << std::endl;
+   return file.good();
+}
+
+static std::vector<std::string> subdirectories(const std::string& path){
+   std::vector<std::string> names;
+   DIR *dir = opendir(path.c_str());
+   if (dir == NULL) return names;
+   struct dirent *filep;
+   while ((filep = readdir(dir))) {
+      std::string name = filep->d_name;
+      struct stat filestat;
+      if (name[0] == '.' || stat((path + name).c_str(), &filestat) || !S_ISDIR(filestat.st_mode)) continue;
+      names.push_back(name);
+   }
+   closedir(dir);
+   std::sort(names.begin(), names.end());
+   return names;
+}
+
+// Adds every root/<subject>/<session>/ that has scans in it, all with the given shape and mask.  Returns
+// how many entries were added.
+int Data_Catalog::discover(const std::string& root, int x, int y, int z, const std::string& maskfile){
+   int added = 0;
+   for (auto subject:subdirectories(root))
+      for (auto session:subdirectories(root + subject + "/")) {
+         Catalog_Entry entry;
+         entry.subject = subject;
+         entry.session = session;
+         entry.source = root + subject + "/" + session + "/";
+         entry.cachefile = context->cachepath + "catalog_" + subject + "_" + session + ".bin";
+         entry.maskfile = maskfile;
+         entry.dims[0] = x, entry.dims[1] = y, entry.dims[2] = z;
+         time_t newest;
+         entry.scans = (int)list_scans(entry.source, newest).size();
+         if (entry.scans == 0) continue;
+         entries.push_back(entry);
+         ++added;
+      }
+   std::cout << "Found " << added << " sessions under " << root << std::endl;
+   return added;
+}
+
+// Parses an entry's scans, compacts them through its mask and writes the cache, unless the cache is newer
+// than every scan.  Only one entry is in memory at a time.
+bool Data_Catalog::build(int e){
+   Catalog_Entry& entry = entries[e];
+   time_t newest;
+   std::vector<std::string> scans = list_scans(entry.source, newest);
+   struct stat cachestat;
+   if (stat(entry.cachefile.c_str(), &cachestat) == 0 && cachestat.st_mtime >= newest) return true;
+   if (scans.empty()) {
+      std::cerr << "No scans in " << entry.source << " and no cache at " << entry.cachefile << std::endl;
+      return false;
+   }
+   
+   entry.scans = (int)scans.size();
+   Input_t *data = gsl_matrix_float_alloc(entry.scans, entry.volume());
+   bool ok = parse_scans(context, scans, data);
+   
+   if (ok && !entry.maskfile.empty()) {
+      gsl_matrix_float *mask = load_gsl_matrix_binary(entry.maskfile);
+      if (mask == NULL || mask->size1*mask->size2 != entry.volume()) {
+         std::cerr << "Mask " << entry.maskfile << " doesn't fit a " << entry.volume() << " voxel volume" << std::endl;
+         ok = false;
+      }
+      else {
+         gsl_vector_float_view voxels = gsl_vector_float_view_array(mask->data, entry.volume());
+         Mask_Index index(&voxels.vector);
+         Input_t *masked = gsl_matrix_float_alloc(entry.scans, index.size());
+         for (int i = 0; i < entry.scans; ++i) index.gather(data->data + i*data->tda, masked->data + i*masked->tda);
+         gsl_matrix_float_free(data);
+         data = masked;
+      }
+      if (mask != NULL) gsl_matrix_float_free(mask);
+   }
+   
+   if (ok) {
+      mkdir(context->cachepath.c_str(), 0755);
+      ok = (bits > 0) ? save_quantized(data, entry.cachefile, bits) : save_gsl_matrix_binary(data, entry.cachefile);
+      std::cout << "Cached " << entry.subject << "/" << entry.session << " (" << data->size1 << "x" << data->size2 << ") in " << entry.cachefile << std::endl;
+   }
+   gsl_matrix_float_free(data);
+   return ok;
+}
+
+// Largest entries first, each to the worker with the fewest scans so far.  Every worker computes the same
+// split, so workers only need their own number.
+std::vector<int> Data_Catalog::shard(int worker, int workers){
+   std::vector<int> by_size(entries.size());
+   for (int e = 0; e < entries.size(); ++e) by_size[e] = e;
+   std::stable_sort(by_size.begin(), by_size.end(), [this](int a, int b){return entries[a].scans > entries[b].scans;});
+   
+   std::vector<long> load(workers, 0);
+   std::vector<int> mine;
+   for (auto e:by_size) {
+      int least = (int)(std::min_element(load.begin(), load.end()) - load.begin());
+      load[least] += entries[e].scans;
+      if (least == worker) mine.push_back(e);
+   }
+   std::sort(mine.begin(), mine.end());
+   return mine;
+}
+
+int Data_Catalog::total_scans(const std::vector<int>& shard){
+   int total = 0;
+   for (auto e:shard) total += entries[e].scans;
+   return total;
+}
+
+// A training set over this worker's entries.  The caches are built first; entries whose cache can't be
+// built or whose width doesn't match the first are left out.  dims and the mask come from the first entry,
+// so the monitors can show features as volumes.
+DataSet *Data_Catalog::stream(int worker, int workers){
+   std::vector<int> mine = shard(worker, workers);
+   DataSet *data = new DataSet(context);
+   data->name = "catalog";
+   data->catalog = this;
+   
+   int width = -1;
+   for (auto e:mine) {
+      if (!build(e)) continue;
+      Mapped_File cache(entries[e].cachefile);
+      uint32_t header[3];
+      if (cache.data == NULL || cache.size < sizeof(header)) continue;
+      memcpy(header, cache.data, sizeof(header));
+      if (width < 0) width = header[2];
+      if (header[2] != width) {
+         std::cerr << entries[e].subject << "/" << entries[e].session << " has " << header[2] << " voxels, expected " << width << ", skipping" << std::endl;
+         continue;
+      }
+      data->shards.push_back(e);
+   }
+   if (data->shards.empty()) {
+      std::cerr << "Worker " << worker << " of " << workers << " has no usable catalog entries" << std::endl;
+      delete data;
+      return NULL;
+   }
+   
+   Catalog_Entry& first = entries[data->shards[0]];
+   for (int d = 0; d < 3; ++d) data->dims[d] = first.dims[d];
+   if (!first.maskfile.empty()) {
+      gsl_matrix_float *mask = load_gsl_matrix_binary(first.maskfile);
+      if (mask != NULL && mask->size1*mask->size2 == first.volume()) {
+         gsl_vector_float *brain = gsl_vector_float_alloc(first.volume());
+         memcpy(brain->data, mask->data, first.volume()*sizeof(float));
+         data->set_mask(brain);
+         data->applymask = true;
+      }
+      if (mask != NULL) gsl_matrix_float_free(mask);
+   }
+   data->open_shard(0);
+   data->dims[3] = total_scans(data->shards);
+   
+   std::cout << "Worker " << worker << " streams " << data->shards.size() << " sessions, " << data->dims[3] << " scans" << std::endl;
+   return data;
+}
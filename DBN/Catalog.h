@@ -0,0 +1,63 @@
+//
+//  Catalog.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Catalog__
+#define __DBN__Catalog__
+
+#include <iostream>
+#include <vector>
+#include "Types.h"
+
+class Context;
+class DataSet;
+
+/////////////////////////////////////
+// Dataset catalog
+/////////////////////////////////////
+
+// One session of one subject: a directory of text scans, its volume shape, an optional mask, and the
+// binary matrix cache the scans get compiled into (masked, one scan per row) the first time it's used.
+class Catalog_Entry {
+public:
+   std::string          subject, session;
+   std::string          source;           // Directory of scan files
+   std::string          cachefile;
+   std::string          maskfile;         // 0/1 binary matrix file with one value per voxel, empty for none
+   int                  dims[3];
+   int                  scans;            // 0 until the source has been listed
+   
+   int volume() {return dims[0]*dims[1]*dims[2];}
+};
+
+// Indexes any number of subjects and sessions so group models can train on all of them without holding
+// them in memory at once.  stream gives each of workers training processes a DataSet over its share of
+// the entries (balanced by scan count); the set maps one entry's cache at a time as train, and the
+// Input_Edge (prefetching or not) moves through the entries within one epoch.
+//
+// The catalog file is plain text, one entry per line:
+//    subject session source_dir cachefile x y z scans maskfile
+// with "-" for no mask.  Lines starting with # are skipped.
+class Data_Catalog {
+public:
+   Context                       *context;
+   std::vector<Catalog_Entry>    entries;
+   int                           bits;       // Caches are built quantized to this many bits, 0 for floats
+   
+   Data_Catalog(Context *context = NULL);
+   
+   bool load(const std::string& filename);
+   bool save(const std::string& filename);
+   int discover(const std::string& root, int x, int y, int z, const std::string& maskfile = "");
+   
+   bool build(int entry);
+   std::vector<int> shard(int worker, int workers);
+   int total_scans(const std::vector<int>& shard);
+   DataSet *stream(int worker = 0, int workers = 1);
+};
+
+#endif /* defined(__DBN__Catalog__) */
@@ -0,0 +1,312 @@
+//
+//  Checkpoint.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include <string.h>
+#include <stdio.h>
+#include "Checkpoint.h"
+#include "MLP.h"
+#include "RBM.h"
+#include "Teacher.h"
+#include "Prefetch.h"
+#include "IO.h"
+#include "Connections.h"
+#include "Layers.h"
+#include "SupportFunctions.h"
+
+namespace {
+   struct Header {
+      uint32_t magic, version;
+      int32_t level, epoch, batch, index, shard, carry;
+      float learning_multiplier;
+      uint32_t rng_size, stream_size, prefetch, streams, order_size, counters, arrays, teacher_arrays;
+   };
+   struct Entry {
+      uint32_t rows, cols;
+      uint64_t offset;
+   };
+   size_t align(size_t n) {return (n + 63) & ~(size_t)63;}
+   
+   void pack(const gsl_matrix_float *m, char *dest){
+      for (int row = 0; row < m->size1; ++row) memcpy(dest + row*m->size2*sizeof(float), m->data + row*m->tda, m->size2*sizeof(float));
+   }
+   void unpack(const char *src, gsl_matrix_float *m){
+      for (int row = 0; row < m->size1; ++row) memcpy(m->data + row*m->tda, src + row*m->size2*sizeof(float), m->size2*sizeof(float));
+   }
+}
+
+Checkpointer::Checkpointer(const std::string &filename, int every) : filename(filename), every(every) {
+   model = NULL;
+   level = epoch = batch = index = shard = carry = 0;
+   learning_multiplier = 1;
+   resuming = false;
+}
+
+Checkpointer::~Checkpointer(){
+   wait();
+   for (auto m:teacher_state) gsl_matrix_float_free(m);
+}
+
+void Checkpointer::wait(){
+   if (writer.joinable()) writer.join();
+}
+
+// The arrays that make up the snapshot, in file order.  Vectors are stored as 1 x n.
+void Checkpointer::collect(MLP *mlp, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_vector_float*> &vectors){
+   std::vector<Layer*> layers;
+   for (auto edge:mlp->edges) {
+      Connection *connection = (Connection*)edge;
+      matrices.push_back(connection->weights);
+      matrices.push_back(connection->mat_update);
+      if (std::find(layers.begin(), layers.end(), edge->from) == layers.end()) layers.push_back(edge->from);
+      if (std::find(layers.begin(), layers.end(), edge->to) == layers.end()) layers.push_back(edge->to);
+   }
+   for (auto layer:layers) {
+      vectors.push_back(layer->biases);
+      vectors.push_back(layer->vec_update);
+   }
+}
+
+// The permutation and prefetcher come from the RBM's first input, the parameters from model if it's set.
+void Checkpointer::save(RBM *rbm, ContrastiveDivergence *teacher, int e, int b, int i, float multiplier){
+   MLP *mlp = (model != NULL) ? (MLP*)model : (MLP*)rbm;
+   std::vector<gsl_matrix_float*> matrices, state;
+   std::vector<gsl_vector_float*> vectors;
+   std::vector<gsl_rng*> streams;
+   std::vector<int*> teacher_counters;
+   collect(mlp, matrices, vectors);
+   teacher->checkpoint_state(rbm, state, streams, teacher_counters);
+   
+   Input_Edge *edge = rbm->inputs.size() ? rbm->inputs[0] : NULL;
+   const gsl_rng *prefetch_rng = (edge != NULL && edge->prefetcher != NULL) ? edge->prefetcher->resume_rng() : NULL;
+   gsl_vector_int *permutation = (edge != NULL) ? edge->order : NULL;
+   
+   Header header;
+   header.magic = magic;
+   header.version = version;
+   header.level = level;
+   header.epoch = e;
+   header.batch = b;
+   header.index = i;
+   header.shard = (edge != NULL) ? edge->dataset->shard : 0;
+   header.carry = (edge != NULL) ? edge->carry : 0;
+   header.learning_multiplier = multiplier;
+   header.rng_size = (uint32_t)gsl_rng_size(mlp->context->rng);
+   header.stream_size = (uint32_t)(streams.size() ? gsl_rng_size(streams[0]) : prefetch_rng != NULL ? gsl_rng_size(prefetch_rng) : 0);
+   header.prefetch = (prefetch_rng != NULL);
+   header.streams = (uint32_t)streams.size();
+   header.order_size = (uint32_t)((permutation != NULL) ? permutation->size : 0);
+   header.counters = (uint32_t)teacher_counters.size();
+   header.arrays = (uint32_t)(matrices.size() + vectors.size());
+   header.teacher_arrays = (uint32_t)state.size();
+   for (auto stream:streams)
+      if (gsl_rng_size(stream) != header.stream_size) {
+         std::cerr << "Checkpoint: the teacher's rngs aren't all the same type, not saved" << std::endl;
+         return;
+      }
+   if (prefetch_rng != NULL && gsl_rng_size(prefetch_rng) != header.stream_size) {
+      std::cerr << "Checkpoint: the prefetcher's rng doesn't match the teacher's, not saved" << std::endl;
+      return;
+   }
+   
+   size_t rng_start = sizeof(Header);
+   size_t order_start = rng_start + header.rng_size + (header.prefetch + header.streams)*header.stream_size;
+   size_t table_start = order_start + (header.order_size + header.counters)*sizeof(int32_t);
+   size_t offset = align(table_start + (header.arrays + header.teacher_arrays)*sizeof(Entry));
+   
+   std::vector<Entry> table;
+   for (auto m:matrices) {
+      table.push_back({(uint32_t)m->size1, (uint32_t)m->size2, offset});
+      offset = align(offset + m->size1*m->size2*sizeof(float));
+   }
+   for (auto v:vectors) {
+      table.push_back({1, (uint32_t)v->size, offset});
+      offset = align(offset + v->size*sizeof(float));
+   }
+   for (auto m:state) {
+      table.push_back({(uint32_t)m->size1, (uint32_t)m->size2, offset});
+      offset = align(offset + m->size1*m->size2*sizeof(float));
+   }
+   
+   // The last write has to be done with the buffer before it's refilled.
+   wait();
+   buffer.assign(offset, 0);
+   char *out = buffer.data();
+   memcpy(out, &header, sizeof(Header));
+   char *rng_out = out + rng_start;
+   memcpy(rng_out, gsl_rng_state(mlp->context->rng), header.rng_size);
+   rng_out += header.rng_size;
+   if (prefetch_rng != NULL) {
+      memcpy(rng_out, gsl_rng_state(prefetch_rng), header.stream_size);
+      rng_out += header.stream_size;
+   }
+   for (auto stream:streams) {
+      memcpy(rng_out, gsl_rng_state(stream), header.stream_size);
+      rng_out += header.stream_size;
+   }
+   int32_t *ints = (int32_t*)(out + order_start);
+   for (int k = 0; k < header.order_size; ++k) *ints++ = permutation->data[k*permutation->stride];
+   for (auto counter:teacher_counters) *ints++ = *counter;
+   memcpy(out + table_start, table.data(), table.size()*sizeof(Entry));
+   
+   int a = 0;
+   for (auto m:matrices) pack(m, out + table[a++].offset);
+   for (auto v:vectors) {
+      float *dest = (float*)(out + table[a++].offset);
+      for (int k = 0; k < v->size; ++k) dest[k] = v->data[k*v->stride];
+   }
+   for (auto m:state) pack(m, out + table[a++].offset);
+   
+   writer = std::thread(&Checkpointer::write_file, this);
+}
+
+void Checkpointer::write_file(){
+   std::string temporary = filename + ".tmp";
+   FILE *file_handle = fopen(temporary.c_str(), "wb");
+   if (file_handle == NULL) {
+      std::cerr << "Could not write checkpoint " << temporary << std::endl;
+      return;
+   }
+   bool ok = (fwrite(buffer.data(), 1, buffer.size(), file_handle) == buffer.size());
+   ok = (fclose(file_handle) == 0) && ok;
+   if (!ok || rename(temporary.c_str(), filename.c_str()) != 0)
+      std::cerr << "Could not write checkpoint " << filename << std::endl;
+}
+
+bool Checkpointer::load(MLP *mlp){
+   if (model != NULL) mlp = model;
+   Mapped_File file(filename);
+   if (file.data == NULL) return false;
+   
+   Header header;
+   if (file.size < sizeof(Header)) {
+      std::cerr << "Bad checkpoint file: " << filename << std::endl;
+      return false;
+   }
+   memcpy(&header, file.data, sizeof(Header));
+   if (header.magic != magic || header.version != version) {
+      std::cerr << "Bad checkpoint file (magic " << std::hex << header.magic << std::dec << ", version " << header.version << "): " << filename << std::endl;
+      return false;
+   }
+   
+   std::vector<gsl_matrix_float*> matrices;
+   std::vector<gsl_vector_float*> vectors;
+   collect(mlp, matrices, vectors);
+   size_t rng_start = sizeof(Header);
+   size_t order_start = rng_start + header.rng_size + (header.prefetch + header.streams)*(size_t)header.stream_size;
+   size_t table_start = order_start + ((size_t)header.order_size + header.counters)*sizeof(int32_t);
+   size_t entries = (size_t)header.arrays + header.teacher_arrays;
+   if (header.arrays != matrices.size() + vectors.size() || file.size < table_start + entries*sizeof(Entry)) {
+      std::cerr << "Checkpoint " << filename << " doesn't match the model" << std::endl;
+      return false;
+   }
+   std::vector<Entry> table(entries);
+   memcpy(table.data(), file.data + table_start, entries*sizeof(Entry));
+   
+   // Check every shape before touching the model.
+   for (int a = 0; a < table.size(); ++a) {
+      size_t rows = table[a].rows, cols = table[a].cols;
+      if (a < header.arrays) {
+         rows = (a < matrices.size()) ? matrices[a]->size1 : 1;
+         cols = (a < matrices.size()) ? matrices[a]->size2 : vectors[a - matrices.size()]->size;
+      }
+      if (table[a].rows != rows || table[a].cols != cols || table[a].offset + rows*cols*sizeof(float) > file.size) {
+         std::cerr << "Checkpoint " << filename << " doesn't match the model" << std::endl;
+         return false;
+      }
+   }
+   
+   int a = 0;
+   for (auto m:matrices) unpack(file.data + table[a++].offset, m);
+   for (auto v:vectors) {
+      const float *src = (const float*)(file.data + table[a++].offset);
+      for (int k = 0; k < v->size; ++k) v->data[k*v->stride] = src[k];
+   }
+   
+   // Everything else waits for restore.
+   for (auto m:teacher_state) gsl_matrix_float_free(m);
+   teacher_state.clear();
+   for (; a < table.size(); ++a) {
+      gsl_matrix_float *m = gsl_matrix_float_alloc(table[a].rows, table[a].cols);
+      unpack(file.data + table[a].offset, m);
+      teacher_state.push_back(m);
+   }
+   const char *rng_in = file.data + rng_start;
+   rng_state.assign(rng_in, rng_in + header.rng_size);
+   rng_in += header.rng_size;
+   prefetch_state.assign(rng_in, rng_in + header.prefetch*header.stream_size);
+   rng_in += header.prefetch*header.stream_size;
+   stream_states.assign(rng_in, rng_in + header.streams*header.stream_size);
+   const int32_t *ints = (const int32_t*)(file.data + order_start);
+   order.assign(ints, ints + header.order_size);
+   counters.assign(ints + header.order_size, ints + header.order_size + header.counters);
+   carry = header.carry;
+   
+   if (header.rng_size == gsl_rng_size(mlp->context->rng)) memcpy(gsl_rng_state(mlp->context->rng), rng_state.data(), header.rng_size);
+   else std::cerr << "Checkpoint rng state doesn't match this rng, not restored" << std::endl;
+   
+   level = header.level;
+   epoch = header.epoch;
+   batch = header.batch;
+   index = header.index;
+   shard = header.shard;
+   learning_multiplier = header.learning_multiplier;
+   resuming = true;
+   std::cout << "Resuming from " << filename << ": level " << level << ", epoch " << epoch << ", batch " << batch << std::endl;
+   return true;
+}
+
+// Called by the teacher once, after the batch is made and the data rewound.  Puts the RBM's input back
+// where the snapshot was (shard, index, permutation, carry, prefetcher rng) and the teacher's chains, rngs
+// and counters, then the context rng last since setting up the teacher's buffers may have drawn from it.
+void Checkpointer::restore(RBM *rbm, ContrastiveDivergence *teacher){
+   resuming = false;
+   std::vector<gsl_matrix_float*> state;
+   std::vector<gsl_rng*> streams;
+   std::vector<int*> teacher_counters;
+   teacher->checkpoint_state(rbm, state, streams, teacher_counters);
+   
+   bool matches = (state.size() == teacher_state.size() && teacher_counters.size() == counters.size());
+   for (int a = 0; matches && a < state.size(); ++a)
+      matches = (state[a]->size1 == teacher_state[a]->size1 && state[a]->size2 == teacher_state[a]->size2);
+   size_t stream_size = streams.size() ? gsl_rng_size(streams[0]) : 0;
+   matches = matches && (streams.size()*stream_size == stream_states.size());
+   if (matches) {
+      for (int a = 0; a < state.size(); ++a) gsl_matrix_float_memcpy(state[a], teacher_state[a]);
+      for (int s = 0; s < streams.size(); ++s) memcpy(gsl_rng_state(streams[s]), stream_states.data() + s*stream_size, stream_size);
+      for (int c = 0; c < counters.size(); ++c) *teacher_counters[c] = counters[c];
+   }
+   else std::cerr << "Checkpoint " << filename << " was saved by a different teacher, its chains and rngs aren't restored" << std::endl;
+   
+   if (rbm->inputs.size()) {
+      Input_Edge *edge = rbm->inputs[0];
+      DataSet *dataset = edge->dataset;
+      if (dataset->catalog != NULL && dataset->shard != shard) dataset->open_shard(shard);
+      dataset->index = index;
+      if (order.size()) {
+         if (edge->order == NULL || edge->order->size != order.size()) {
+            if (edge->order != NULL) gsl_vector_int_free(edge->order);
+            edge->order = gsl_vector_int_alloc(order.size());
+         }
+         for (int k = 0; k < order.size(); ++k) gsl_vector_int_set(edge->order, k, order[k]);
+      }
+      edge->carry = carry;
+      
+      // A fresh prefetcher, so nothing was requested with the rng before it's set.
+      if (edge->prefetcher != NULL && prefetch_state.size()) {
+         edge->set_prefetch(false);
+         edge->set_prefetch(true);
+         if (!edge->prefetcher->set_rng(prefetch_state))
+            std::cerr << "Checkpoint prefetcher rng doesn't match this rng, not restored" << std::endl;
+      }
+   }
+   
+   if (rng_state.size() == gsl_rng_size(rbm->context->rng)) memcpy(gsl_rng_state(rbm->context->rng), rng_state.data(), rng_state.size());
+   
+   for (auto m:teacher_state) gsl_matrix_float_free(m);
+   teacher_state.clear();
+}
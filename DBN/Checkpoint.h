@@ -0,0 +1,77 @@
+//
+//  Checkpoint.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Checkpoint__
+#define __DBN__Checkpoint__
+
+#include <iostream>
+#include <thread>
+#include <stdint.h>
+#include "Types.h"
+
+class MLP;
+class RBM;
+class Layer;
+class ContrastiveDivergence;
+
+/////////////////////////////////////
+// Checkpoints
+/////////////////////////////////////
+
+// Binary snapshots of a model and where training was, so long runs can be resumed.  The file is a fixed
+// header (magic, version, DBN level, epoch, batch, dataset index and shard, carry, learning multiplier and
+// the sizes of what follows), the context rng state, the prefetcher's and the teacher's rng states, the
+// shuffle permutation, the teacher's counters, a table of (rows, cols, offset) entries, then the arrays
+// themselves at 64 byte aligned offsets: the weights and weight momentum of every connection in
+// model->edges order, the biases and bias momentum of every layer in the order they're first seen, and last
+// the teacher's own state (ContrastiveDivergence::checkpoint_state, e.g. the persistent chains).
+//
+// load copies the model straight out of the mapping and keeps the rest.  The teacher calls restore once it
+// has set up its batch and buffers, which puts back the permutation, the chains and the rngs, so a resumed
+// run draws the same batches and noise as the one that was interrupted.
+//
+// save copies the parameters into a buffer on the calling thread and hands the buffer to a writer thread,
+// which writes a temporary file and renames it over the old one, so a crash mid-write leaves the last good
+// checkpoint.  A save only waits if the previous write hasn't finished.
+class Checkpointer {
+public:
+   static const uint32_t      magic = 0x44424e43;   // "DBNC"
+   static const uint32_t      version = 2;
+   
+   std::string                filename;
+   int                        every;                // Batches between snapshots, 0 for end of epoch only.
+   MLP                        *model;               // Snapshotted model, the RBM being taught if NULL.
+   
+   // Where training is (or, after load, where it should pick up).
+   int                        level, epoch, batch, index, shard;
+   float                      learning_multiplier;
+   bool                       resuming;
+   
+   Checkpointer(const std::string &filename, int every = 0);
+   ~Checkpointer();
+   
+   void save(RBM *rbm, ContrastiveDivergence *teacher, int epoch, int batch, int index, float learning_multiplier);
+   bool load(MLP *mlp);
+   void restore(RBM *rbm, ContrastiveDivergence *teacher);
+   void wait();
+   
+private:
+   std::thread                writer;
+   std::vector<char>          buffer;
+   
+   // Read by load, put back by restore.
+   int                              carry;
+   std::vector<char>                rng_state, prefetch_state, stream_states;
+   std::vector<int>                 order, counters;
+   std::vector<gsl_matrix_float*>   teacher_state;
+   
+   void collect(MLP *mlp, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_vector_float*> &vectors);
+   void write_file();
+};
+
+#endif /* defined(__DBN__Checkpoint__) */
@@ -14,12 +14,12 @@ Connection::Connection(Layer *from_layer, Layer *to_layer) {
    learning_on = true;
    from = from_layer, to = to_layer;
    
-   weights = gsl_matrix_float_alloc(to->nodenum, from->nodenum);
+   weights = from->context->alloc_matrix(to->nodenum, from->nodenum);
    for (int i = 0; i < to->nodenum; ++i)
       for (int j = 0; j < from->nodenum; ++j)
-         gsl_matrix_float_set(weights, i, j, (float)gsl_ran_gaussian(r, 0.01));
+         gsl_matrix_float_set(weights, i, j, (float)gsl_ran_gaussian(from->context->rng, 0.01));
    
-   mat_update = gsl_matrix_float_calloc(to->nodenum, from->nodenum);
+   mat_update = from->context->calloc_matrix(to->nodenum, from->nodenum);
    node_projections = gsl_vector_float_alloc(from->nodenum);
 }
 
@@ -62,6 +62,15 @@ int Connection::transmit_signal(Sample_flag_t s_flag){
    return 1;
 }
 
+// One h -> v -> h sweep on caller-owned buffers, for samplers that keep their own chains.  Each buffer is
+// nodenum x n for its layer; the expectations are computed in place, then sampled.
+void Connection::gibbs_sweep(gsl_matrix_float *v_samples, gsl_matrix_float *v_exps, gsl_matrix_float *h_samples, gsl_matrix_float *h_exps, const gsl_rng *rng, float beta){
+   gsl_blas_sgemm(CblasTrans, CblasNoTrans, 1, weights, h_samples, 0, v_exps);
+   from->fused_activation(v_exps, v_exps, v_samples, rng, beta);
+   gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, weights, v_samples, 0, h_exps);
+   to->fused_activation(h_exps, h_exps, h_samples, rng, beta);
+}
+
 void Connection::catch_stats(Stat_flag_t stat_flag, Sample_flag_t sample_flag){
    
    stat1 = to->stat1;
@@ -82,11 +91,11 @@ void Connection::update(ContrastiveDivergence* teacher){
    to->update(teacher);
    
    gsl_matrix_float *weight_update = mat_update;
-   float rate = teacher->learning_multiplier*learning_rate/((float)teacher->batchsize);
+   float rate = teacher->learning_multiplier*learning_rate;
    //learning_rate/=(float)teacher->batchsize;
    
-   gsl_blas_sgemm(CblasNoTrans, CblasTrans , rate, stat1, stat2, teacher->momentum, weight_update);
-   gsl_blas_sgemm(CblasNoTrans, CblasTrans , -rate, stat3, stat4, 1, weight_update);
+   gsl_blas_sgemm(CblasNoTrans, CblasTrans , rate/(float)stat1->size2, stat1, stat2, teacher->momentum, weight_update);
+   gsl_blas_sgemm(CblasNoTrans, CblasTrans , -rate/(float)stat3->size2, stat3, stat4, 1, weight_update);
    
    gsl_matrix_float *weightdecay = gsl_matrix_float_alloc(weights->size1, weights->size2);
    gsl_matrix_float_memcpy(weightdecay, weights);
@@ -96,4 +105,43 @@ void Connection::update(ContrastiveDivergence* teacher){
    gsl_matrix_float_add(weights, weight_update);
    
    gsl_matrix_float_free(weightdecay);
+}
+
+// Free energy of each column of v (from->nodenum x n) into energy, with x (to->nodenum x n) as scratch:
+// the visible terms, one GEMM and the hidden layer's reduction.
+void Connection::getFreeEnergy(gsl_matrix_float *v, gsl_matrix_float *x, gsl_vector_float *energy){
+   gsl_vector_float_set_zero(energy);
+   from->unit_energy(v, energy);
+   gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, weights, v, 0, x);
+   to->freeEnergy_contibution(x, energy);
+}
+
+// Mean free energy of the current batch of visible samples.
+void Connection::getFreeEnergy(){
+   gsl_matrix_float *x = gsl_matrix_float_alloc(to->nodenum, from->batchsize);
+   gsl_vector_float *energy = gsl_vector_float_alloc(from->batchsize);
+   getFreeEnergy(from->samples, x, energy);
+   freeEnergy = gsl_stats_float_mean(energy->data, energy->stride, energy->size);
+   gsl_matrix_float_free(x);
+   gsl_vector_float_free(energy);
+}
+
+// The update above, but from gradients that were already summed over n samples somewhere else (the
+// data-parallel teacher reduces them across threads).  gradient is to x from, like the weights.
+void Connection::apply_gradient(ContrastiveDivergence *teacher, gsl_matrix_float *gradient, gsl_vector_float *from_gradient, gsl_vector_float *to_gradient, int n){
+   if (!learning_on) return;
+   from->learning_rate = learning_rate;
+   to->learning_rate = learning_rate;
+   from->apply_gradient(teacher, from_gradient, n);
+   to->apply_gradient(teacher, to_gradient, n);
+   
+   float rate = teacher->learning_multiplier*learning_rate;
+   gsl_matrix_float_scale(mat_update, teacher->momentum);
+   for (int i = 0; i < weights->size1; ++i) {
+      float *u = mat_update->data + i*mat_update->tda;
+      const float *g = gradient->data + i*gradient->tda;
+      const float *w = weights->data + i*weights->tda;
+      for (int j = 0; j < weights->size2; ++j) u[j] += (rate/(float)n)*g[j] - decay*w[j];
+   }
+   gsl_matrix_float_add(weights, mat_update);
 }
\ No newline at end of file
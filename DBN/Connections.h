@@ -36,11 +36,14 @@ public:
    void make_batch(int batchsize);
    
    int transmit_signal(Sample_flag_t s_flag);
+   void gibbs_sweep(gsl_matrix_float *v_samples, gsl_matrix_float *v_exps, gsl_matrix_float *h_samples, gsl_matrix_float *h_exps, const gsl_rng *rng, float beta = 1);
    
    void catch_stats(Stat_flag_t, Sample_flag_t);
    void update(ContrastiveDivergence*);
+   void apply_gradient(ContrastiveDivergence*, gsl_matrix_float *gradient, gsl_vector_float *from_gradient, gsl_vector_float *to_gradient, int n);
    
    void getFreeEnergy();
+   void getFreeEnergy(gsl_matrix_float *v, gsl_matrix_float *x, gsl_vector_float *energy);
 };
 
 #endif /* defined(__DBN__Connections__) */
\ No newline at end of file
@@ -0,0 +1,81 @@
+//
+//  Context.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include <unistd.h>
+#include <time.h>
+#include "Context.h"
+#include "Threads.h"
+
+Context *Context::gui = NULL;
+
+Context::Context(const std::string &root, unsigned long s) : seed(s) {
+   if (seed == 0) seed = time(NULL)*getpid();
+   rng = gsl_rng_alloc(gsl_rng_rand48);
+   gsl_rng_set(rng, seed);
+   set_root(root);
+   monitor = NULL;
+   viz = NULL;
+   threads = NULL;
+}
+
+Context::~Context(){
+   if (threads != NULL) delete threads;
+   gsl_rng_free(rng);
+   if (gui == this) gui = NULL;
+}
+
+void Context::set_root(const std::string &root){
+   path = root;
+   MNISTpath = path + "MNISTdata/";
+   plotpath = path + "plots/";
+   fMRIpath = path + "fMRIdata";
+   SPMpath = path + "SPMdata/";
+   vertexPath = path + "Shaders/Vertex.c";
+   fragmentPath = path + "Shaders/Fragment.c";
+   fMRI_3D_path = path + "fMRIdata3D1/";
+   cachepath = path + "cache/";
+}
+
+gsl_rng *Context::new_stream(){
+   std::lock_guard<std::mutex> guard(lock);
+   gsl_rng *stream = gsl_rng_alloc(gsl_rng_rand48);
+   gsl_rng_set(stream, gsl_rng_get(rng));
+   return stream;
+}
+
+Thread_Pool *Context::pool(){
+   std::lock_guard<std::mutex> guard(lock);
+   if (threads == NULL) threads = new Thread_Pool();
+   return threads;
+}
+
+// gsl frees the block data with free(), which is fine for posix_memalign memory.
+gsl_matrix_float *Context::alloc_matrix(int rows, int cols){
+   gsl_block_float *block = (gsl_block_float*)malloc(sizeof(gsl_block_float));
+   void *data;
+   if (block == NULL || posix_memalign(&data, 64, std::max(1, rows*cols)*sizeof(float)) != 0) {
+      std::cerr << "Could not allocate a " << rows << "x" << cols << " matrix" << std::endl;
+      exit(EXIT_FAILURE);
+   }
+   block->size = rows*cols;
+   block->data = (float*)data;
+   gsl_matrix_float *m = gsl_matrix_float_alloc_from_block(block, 0, rows, cols, cols);
+   m->owner = 1;
+   return m;
+}
+
+gsl_matrix_float *Context::calloc_matrix(int rows, int cols){
+   gsl_matrix_float *m = alloc_matrix(rows, cols);
+   gsl_matrix_float_set_zero(m);
+   return m;
+}
+
+Context *Context::default_context(){
+   static Context *context = new Context();
+   return context;
+}
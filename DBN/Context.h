@@ -0,0 +1,61 @@
+//
+//  Context.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Context__
+#define __DBN__Context__
+
+#include <iostream>
+#include <mutex>
+#include "Types.h"
+
+class Thread_Pool;
+class Monitor;
+class Visualizer;
+
+/////////////////////////////////////
+// Context
+/////////////////////////////////////
+
+// Everything a model or trainer used to get from globals: the main rng, the data and output paths, a
+// shared thread pool, aligned matrix allocation and the monitor/visualizer.  Layers, connections, MLPs,
+// datasets and teachers each hold the context they were made with, so two experiments with their own
+// contexts don't share any state and can run side by side.  Objects made without one get default_context(), which
+// is seeded from the clock like main used to be.
+class Context {
+public:
+   gsl_rng                    *rng;
+   unsigned long              seed;
+   
+   std::string                path;
+   std::string                MNISTpath, plotpath, fMRIpath, SPMpath, fMRI_3D_path, cachepath;
+   std::string                vertexPath, fragmentPath;
+   
+   Monitor                    *monitor;
+   Visualizer                 *viz;
+   
+   Context(const std::string &root = "/home/pliz/soft/src/dev/tools/DBN-2.0/", unsigned long seed = 0);
+   ~Context();
+   
+   void set_root(const std::string &root);
+   
+   gsl_rng *new_stream();                                // Independent rng seeded off this one, caller frees.
+   Thread_Pool *pool();                                  // Made on first use.
+   gsl_matrix_float *alloc_matrix(int rows, int cols);   // 64 byte aligned rows, free with gsl_matrix_float_free.
+   gsl_matrix_float *calloc_matrix(int rows, int cols);  // The same, zeroed.
+   
+   static Context *default_context();
+   
+   // The context whose monitor gets the window's key presses (GLFW only has the one window).
+   static Context             *gui;
+   
+private:
+   Thread_Pool                *threads;
+   std::mutex                 lock;
+};
+
+#endif /* defined(__DBN__Context__) */
@@ -12,18 +12,32 @@
 #include "Layers.h"
 #include "IO.h"
 #include "Monitors.h"
+#include "Checkpoint.h"
 
-DBN::DBN() {rc_MLP = new MLP;}
+DBN::DBN(Context *context) : MLP(context) {rc_MLP = new MLP(this->context);}
 
 void DBN::learn(){
    teacher->monitor->teacher = teacher;
    int level = 0;
+   int resume_level = 0;
+   Checkpointer *checkpointer = teacher->checkpointer;
+   if (checkpointer != NULL) {
+      if (checkpointer->model == NULL) checkpointer->model = this;
+      if (checkpointer->resuming) resume_level = checkpointer->level;
+   }
    for (auto input:inputs) rc_MLP->add(input);
    while (1){
       RBM *rbm = make_rbm_level(level);
       for (auto edge:(rbm->edges)) rc_MLP->add((Connection*)edge);
       
       if (rbm->edges.size() == 0) break;
+      
+      // Levels below the checkpoint are already trained.
+      if (level < resume_level) {
+         ++level;
+         continue;
+      }
+      if (checkpointer != NULL) checkpointer->level = level;
       //if (level > 0) rbm->toggle_noise();
       
       rbm->teacher = teacher;
@@ -23,7 +23,7 @@ public:
    
    MLP   *rc_MLP;
    
-   DBN();
+   DBN(Context *context = NULL);
    
    void learn();
 };
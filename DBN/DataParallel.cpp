@@ -0,0 +1,139 @@
+//
+//  DataParallel.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include "DataParallel.h"
+#include "RBM.h"
+#include "Connections.h"
+#include "Layers.h"
+#include "IO.h"
+#include "Threads.h"
+#include "MLP.h"
+
+Data_Parallel_CD::Data_Parallel_CD(float momentum, int k, int batchsize, int epochs, int workers, Thread_Pool *threads) : ContrastiveDivergence(momentum, k, batchsize, epochs), threads(threads)
+{
+   if (this->threads == NULL) this->threads = context->pool();
+   if (workers <= 0) workers = this->threads->size();
+   this->workers = std::min(workers, batchsize);
+   owner = NULL;
+   
+   for (int t = 0; t < this->workers; ++t) {
+      rngs.push_back(context->new_stream());
+      first_column.push_back(t*batchsize/this->workers);
+   }
+   first_column.push_back(batchsize);
+}
+
+void Data_Parallel_CD::free_buffers(){
+   for (int t = 0; t < v_data.size(); ++t) {
+      gsl_matrix_float_free(v_data[t]);
+      gsl_matrix_float_free(h_data[t]);
+      gsl_matrix_float_free(v_samples[t]);
+      gsl_matrix_float_free(v_exps[t]);
+      gsl_matrix_float_free(h_samples[t]);
+      gsl_matrix_float_free(h_exps[t]);
+      gsl_matrix_float_free(weight_gradients[t]);
+      gsl_vector_float_free(v_gradients[t]);
+      gsl_vector_float_free(h_gradients[t]);
+   }
+   v_data.clear(); h_data.clear(); v_samples.clear(); v_exps.clear(); h_samples.clear(); h_exps.clear();
+   weight_gradients.clear(); v_gradients.clear(); h_gradients.clear();
+}
+
+void Data_Parallel_CD::init_buffers(RBM *rbm){
+   free_buffers();
+   Connection *connection = (Connection*)rbm->edges[0];
+   int visible = connection->from->nodenum, hidden = connection->to->nodenum;
+   
+   for (int t = 0; t < workers; ++t) {
+      int columns = first_column[t+1] - first_column[t];
+      v_data.push_back(context->alloc_matrix(visible, columns));
+      h_data.push_back(context->alloc_matrix(hidden, columns));
+      v_samples.push_back(context->alloc_matrix(visible, columns));
+      v_exps.push_back(context->alloc_matrix(visible, columns));
+      h_samples.push_back(context->alloc_matrix(hidden, columns));
+      h_exps.push_back(context->alloc_matrix(hidden, columns));
+      weight_gradients.push_back(context->alloc_matrix(hidden, visible));
+      v_gradients.push_back(gsl_vector_float_alloc(visible));
+      h_gradients.push_back(gsl_vector_float_alloc(hidden));
+   }
+   owner = rbm;
+}
+
+// The same statistics as catch_stats: visible data and hidden samples for the positive phase, visible samples
+// and hidden expectations for the negative one.
+// The batch (already corrupted, if the visible layer is noisy) is in the visible layer's samples.
+void Data_Parallel_CD::worker_stats(Connection *connection, int t){
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   gsl_rng *rng = rngs[t];
+   int columns = first_column[t+1] - first_column[t];
+   gsl_vector_float_const_view ones = gsl_vector_float_const_subvector(identity, 0, columns);
+   
+   gsl_matrix_float_view slice = gsl_matrix_float_submatrix(visible->samples, 0, first_column[t], visible->nodenum, columns);
+   gsl_matrix_float_memcpy(v_data[t], &slice.matrix);
+   
+   // Positive phase
+   gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, connection->weights, v_data[t], 0, h_exps[t]);
+   hidden->fused_activation(h_exps[t], h_exps[t], h_samples[t], rng);
+   gsl_matrix_float_memcpy(h_data[t], h_samples[t]);
+   
+   gsl_blas_sgemm(CblasNoTrans, CblasTrans, 1, h_data[t], v_data[t], 0, weight_gradients[t]);
+   gsl_blas_sgemv(CblasNoTrans, 1, v_data[t], &ones.vector, 0, v_gradients[t]);
+   gsl_blas_sgemv(CblasNoTrans, 1, h_data[t], &ones.vector, 0, h_gradients[t]);
+   
+   // Negative phase
+   for (int g = 0; g < k; ++g) connection->gibbs_sweep(v_samples[t], v_exps[t], h_samples[t], h_exps[t], rng);
+   
+   gsl_blas_sgemm(CblasNoTrans, CblasTrans, -1, h_exps[t], v_samples[t], 1, weight_gradients[t]);
+   gsl_blas_sgemv(CblasNoTrans, -1, v_samples[t], &ones.vector, 1, v_gradients[t]);
+   gsl_blas_sgemv(CblasNoTrans, -1, h_exps[t], &ones.vector, 1, h_gradients[t]);
+}
+
+// Pairwise sums into worker 0: (0+1, 2+3, ...), then (0+2, 4+6, ...) and so on.  The order of the additions
+// only depends on the number of workers.
+void Data_Parallel_CD::reduce(){
+   for (int stride = 1; stride < workers; stride *= 2) {
+      int pairs = (workers - stride + 2*stride - 1)/(2*stride);
+      threads->run(pairs, [&](int task, int worker){
+         int a = task*2*stride, b = a + stride;
+         gsl_matrix_float_add(weight_gradients[a], weight_gradients[b]);
+         gsl_vector_float_add(v_gradients[a], v_gradients[b]);
+         gsl_vector_float_add(h_gradients[a], h_gradients[b]);
+      });
+   }
+}
+
+// The worker rngs; the negative chains restart from the data every batch.
+void Data_Parallel_CD::checkpoint_state(RBM *rbm, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters){
+   for (auto rng:rngs) streams.push_back(rng);
+}
+
+// Single connection RBMs with one input get the data-parallel step, anything else the plain CD one.
+void Data_Parallel_CD::teachRBM(RBM *rbm){
+   if (rbm->edges.size() == 1 && rbm->inputs.size() == 1) {
+      if (owner != rbm) init_buffers(rbm);
+   }
+   else owner = NULL;
+   ContrastiveDivergence::teachRBM(rbm);
+}
+
+int Data_Parallel_CD::next_batch(RBM *rbm){
+   if (owner != rbm) return ContrastiveDivergence::next_batch(rbm);
+   return rbm->inputs[0]->pull_data(SAMPLE);
+}
+
+void Data_Parallel_CD::train_batch(RBM *rbm){
+   if (owner != rbm) {
+      ContrastiveDivergence::train_batch(rbm);
+      return;
+   }
+   Connection *connection = (Connection*)rbm->edges[0];
+   threads->run(workers, [&](int t, int worker){ worker_stats(connection, t); });
+   reduce();
+   connection->apply_gradient(this, weight_gradients[0], v_gradients[0], h_gradients[0], batchsize);
+}
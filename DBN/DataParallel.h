@@ -0,0 +1,55 @@
+//
+//  DataParallel.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__DataParallel__
+#define __DBN__DataParallel__
+
+#include <iostream>
+#include "Teacher.h"
+
+class RBM;
+class Connection;
+class Thread_Pool;
+
+/////////////////////////////////////
+// Data-parallel CD
+/////////////////////////////////////
+
+// CD-k with each minibatch split by columns over a fixed number of workers.  The batch is pulled once through
+// the RBM's Input_Edge, so shuffling, prefetching, mapped or quantized data and catalog shards all work as
+// they do for plain CD.  Every worker copies out its slice of the columns, runs the positive phase and k
+// fused Gibbs sweeps on its own buffers and sums its (pos - neg) gradients.  The worker gradients are then added pairwise in a fixed tree and
+// applied once.  Worker t always gets the same columns and rng t, so a run is bit-reproducible for a given
+// number of workers whatever the thread scheduling, and whatever pool runs them (the context's by default).
+// Single connection RBMs only, others get plain CD.
+class Data_Parallel_CD : public ContrastiveDivergence {
+public:
+   int                              workers;
+   Thread_Pool                      *threads;
+   RBM                              *owner;
+   
+   std::vector<gsl_rng*>            rngs;
+   std::vector<int>                 first_column;
+   std::vector<gsl_matrix_float*>   v_data, h_data, v_samples, v_exps, h_samples, h_exps;
+   std::vector<gsl_matrix_float*>   weight_gradients;
+   std::vector<gsl_vector_float*>   v_gradients, h_gradients;
+   
+   ~Data_Parallel_CD(){}
+   Data_Parallel_CD(float momentum, int k, int batchsize, int epochs, int workers = 0, Thread_Pool *threads = NULL);
+   
+   void init_buffers(RBM*);
+   void free_buffers();
+   void worker_stats(Connection*, int t);
+   void reduce();
+   void teachRBM(RBM *rbm);
+   int next_batch(RBM *rbm);
+   void train_batch(RBM *rbm);
+   void checkpoint_state(RBM*, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters);
+};
+
+#endif /* defined(__DBN__DataParallel__) */
@@ -9,16 +9,17 @@
 #include <iostream>
 #include "Layers.h"
 #include "IO.h"
+#include "Preprocess.h"
 
-GaussianLayer::GaussianLayer(int n) : Layer(n) {
+GaussianLayer::GaussianLayer(int n, Context *context) : Layer(n, context) {
    noise = 0.1;
    biases = gsl_vector_float_calloc(nodenum);
    vec_update2 = gsl_vector_float_calloc(nodenum);
-   stat3 = gsl_matrix_float_alloc(nodenum, batchsize);
-   stat4 = gsl_matrix_float_alloc(nodenum, batchsize);
+   stat3 = this->context->alloc_matrix(nodenum, batchsize);
+   stat4 = this->context->alloc_matrix(nodenum, batchsize);
    setsigma = 1;
    for (int i = 0; i < nodenum; ++i)
-      gsl_vector_float_set(biases, i, (float)gsl_ran_gaussian(r, 0.01));
+      gsl_vector_float_set(biases, i, (float)gsl_ran_gaussian(context->rng, 0.01));
    quad_coefficients = gsl_vector_float_alloc(nodenum);
    gsl_vector_float_set_all(quad_coefficients, (float)1/sqrtf(2));
    sigmas = gsl_vector_float_alloc(nodenum);
@@ -30,8 +31,8 @@ void GaussianLayer::makeBatch(int bs){
    Layer::make_batch(bs);
    gsl_matrix_float_free(stat3);
    gsl_matrix_float_free(stat4);
-   stat3 = gsl_matrix_float_calloc(nodenum, batchsize);
-   stat4 = gsl_matrix_float_calloc(nodenum, batchsize);
+   stat3 = this->context->calloc_matrix(nodenum, batchsize);
+   stat4 = this->context->calloc_matrix(nodenum, batchsize);
 }
 
 void GaussianLayer::getExpectations(){
@@ -55,12 +56,64 @@ void GaussianLayer::sample(){
       float sigma = gsl_vector_float_get(sigmas, i);
       for (int j = 0; j < batchsize; ++j) {
          float exp = (sigma*sigma)*gsl_matrix_float_get(expectations, i, j);
-         float sam = (exp + gsl_ran_gaussian(r, sigma));
+         float sam = (exp + gsl_ran_gaussian(context->rng, sigma));
          gsl_matrix_float_set(samples, i, j, sam);
       }
    }
 }
 
+// Tempering a gaussian only widens it, so beta goes into the variance and the mean is left alone.
+void GaussianLayer::fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta){
+   for (int i = 0; i < x->size1; ++i){
+      float bias = gsl_vector_float_get(biases, i);
+      float sigma = gsl_vector_float_get(sigmas, i);
+      float *act = x->data + i*x->tda;
+      float *exp = exps->data + i*exps->tda;
+      float *sam = (samps == NULL) ? NULL : samps->data + i*samps->tda;
+      for (int j = 0; j < x->size2; ++j){
+         exp[j] = act[j] + bias;
+         if (sam == NULL) continue;
+         sam[j] = (sigma*sigma)*exp[j] + gsl_ran_gaussian(rng, sigma/sqrtf(beta));
+         if (noisy) sam[j] *= (gsl_rng_uniform(rng) >= noise);
+      }
+   }
+}
+
+// Quadratic term to match the sampling above: v ~ N(sigma^2(x + b), sigma^2) comes from v^2/2sigma^2 - b.v.
+void GaussianLayer::unit_energy(gsl_matrix_float *states, gsl_vector_float *energy){
+   Layer::unit_energy(states, energy);
+   for (int i = 0; i < states->size1; ++i){
+      float sigma = gsl_vector_float_get(sigmas, i);
+      float *s = states->data + i*states->tda;
+      for (int j = 0; j < states->size2; ++j)
+         energy->data[j*energy->stride] += s[j]*s[j]/(2*sigma*sigma);
+   }
+}
+
+// Integrating out h with the energy above gives -sigma^2(x + b)^2/2.
+void GaussianLayer::freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy){
+   for (int i = 0; i < x->size1; ++i){
+      float bias = gsl_vector_float_get(biases, i);
+      float sigma = gsl_vector_float_get(sigmas, i);
+      const float *act = x->data + i*x->tda;
+      for (int j = 0; j < x->size2; ++j) {
+         float a = act[j] + bias;
+         energy->data[j*energy->stride] -= sigma*sigma*a*a/2;
+      }
+   }
+}
+
+// Each unit integrates to sqrt(2 pi) sigma exp(sigma^2 (b + x)^2/2).
+double GaussianLayer::log_partition(const double *x){
+   double logZ = 0;
+   for (int i = 0; i < nodenum; ++i) {
+      double sigma = gsl_vector_float_get(sigmas, i);
+      double bias = gsl_vector_float_get(biases, i) + (x ? x[i] : 0);
+      logZ += 0.5*log(2*M_PI) + log(sigma) + sigma*sigma*bias*bias/2;
+   }
+   return logZ;
+}
+
 void GaussianLayer::update(ContrastiveDivergence *teacher){
    Layer::update(teacher);
    /*if (0){
@@ -97,54 +150,26 @@ void GaussianLayer::update(ContrastiveDivergence *teacher){
    }*/
 }
 
+// Standardizes every column of the data to sd setsigma with train's statistics (fit in one pass and
+// applied in one more, see Preprocessor).  With setsigma <= 0 the data are left alone and the unit sigmas
+// take the column sds instead.
 void GaussianLayer::shapeInput(DataSet *data){
-   Input_t *input = data->train;
-   gsl_vector_float *col = gsl_vector_float_alloc(input->size1);
-   if (setsigma > 0) {
-      data->norm = gsl_vector_float_alloc(data->train->size2);
-      data->denorm = true;
-      for (int j = 0; j < input->size2; ++j) {
-         gsl_matrix_float_get_col(col, input, j);
-         float mean = gsl_stats_float_mean(col->data, col->stride, col->size);
-         float sd = gsl_stats_float_sd(col->data, col->stride, col->size);
-         gsl_vector_float_add_constant(col, -mean);
-         gsl_vector_float_scale(col, setsigma/sd);
-         gsl_matrix_float_set_col(input, j, col);
-         gsl_vector_float_set(data->norm, j, sd);
-      }
+   if (setsigma > 0 && !data->preprocessing.empty()) {
+      Preprocessor *last = data->preprocessing.back();
+      if (last->center && last->sigma == setsigma && !last->masking) return;
    }
-   else {
-      data->denorm = false;
-      for (int j = 0; j < input->size2; ++j) {
-         float sd = gsl_stats_float_sd(col->data, col->stride, col->size);
-         gsl_vector_float_set(sigmas, j, sd);
-      }
-   }
-   gsl_vector_float_free(col);
    
-   input = data->extra;
-   col = gsl_vector_float_alloc(input->size1);
+   Preprocessor *standardize = new Preprocessor(true, setsigma, false);
+   data->fit(standardize);
    if (setsigma > 0) {
-      data->norm = gsl_vector_float_alloc(data->train->size2);
-      data->denorm = true;
-      for (int j = 0; j < input->size2; ++j) {
-         gsl_matrix_float_get_col(col, input, j);
-         float mean = gsl_stats_float_mean(col->data, col->stride, col->size);
-         float sd = gsl_stats_float_sd(col->data, col->stride, col->size);
-         gsl_vector_float_add_constant(col, -mean);
-         gsl_vector_float_scale(col, setsigma/sd);
-         gsl_matrix_float_set_col(input, j, col);
-         gsl_vector_float_set(data->norm, j, sd);
-      }
+      data->preprocess(standardize);
+      return;
    }
-   else {
-      data->denorm = false;
-      for (int j = 0; j < input->size2; ++j) {
-         float sd = gsl_stats_float_sd(col->data, col->stride, col->size);
-         gsl_vector_float_set(sigmas, j, sd);
-      }
-   }
-   gsl_vector_float_free(col);
+   
+   data->denorm = false;
+   for (int j = 0; j < nodenum && j < standardize->input_size(); ++j)
+      gsl_vector_float_set(sigmas, j, gsl_vector_float_get(standardize->sd, j));
+   delete standardize;
 }
 
 float GaussianLayer::reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_float *modelMat){
@@ -0,0 +1,233 @@
+//
+//  Hogwild.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include <chrono>
+#include "Hogwild.h"
+#include "RBM.h"
+#include "Connections.h"
+#include "Layers.h"
+#include "IO.h"
+#include "Monitors.h"
+#include "Threads.h"
+#include "Checkpoint.h"
+#include "MLP.h"
+
+Hogwild_CD::Hogwild_CD(float momentum, int k, int batchsize, int epochs, int workers) : ContrastiveDivergence(momentum, k, batchsize, epochs)
+{
+   if (momentum != 0) {
+      std::cerr << "Hogwild CD has no momentum, ignoring " << momentum << std::endl;
+      this->momentum = 0;
+   }
+   threads = NULL;
+   owns_threads = false;
+   owner = NULL;
+   timing = false;
+   set_workers(workers);
+}
+
+Hogwild_CD::~Hogwild_CD(){
+   if (owns_threads) delete threads;
+}
+
+// Every worker is one long task that holds its thread for the epoch, so a count other than the shared pool's
+// size gets a pool of its own.
+void Hogwild_CD::set_workers(int n){
+   Thread_Pool *shared = context->pool();
+   if (n <= 0) n = shared->size();
+   workers = n;
+   if (owns_threads) delete threads;
+   owns_threads = (workers != shared->size());
+   threads = owns_threads ? new Thread_Pool(workers) : shared;
+   while (rngs.size() < workers) rngs.push_back(context->new_stream());
+   owner = NULL;
+}
+
+void Hogwild_CD::init_buffers(RBM *rbm){
+   std::vector<gsl_matrix_float*> *buffers[] = {&v_data, &h_data, &v_samples, &v_exps, &h_samples, &h_exps, &staging};
+   for (auto buffer:buffers) {
+      for (auto m:*buffer) gsl_matrix_float_free(m);
+      buffer->clear();
+   }
+   
+   Connection *connection = (Connection*)rbm->edges[0];
+   int visible = connection->from->nodenum, hidden = connection->to->nodenum;
+   int columns = (int)rbm->inputs[0]->dataset->train->size2;
+   for (int t = 0; t < workers; ++t) {
+      staging.push_back(context->alloc_matrix(batchsize, columns));
+      v_data.push_back(context->alloc_matrix(visible, batchsize));
+      h_data.push_back(context->alloc_matrix(hidden, batchsize));
+      v_samples.push_back(context->alloc_matrix(visible, batchsize));
+      v_exps.push_back(context->alloc_matrix(visible, batchsize));
+      h_samples.push_back(context->alloc_matrix(hidden, batchsize));
+      h_exps.push_back(context->alloc_matrix(hidden, batchsize));
+   }
+   owner = rbm;
+}
+
+// One CD-k step on the batch at position index of the edge's epoch (rows order[index..] when shuffled,
+// otherwise index.. wrapping past the last row), written into the shared parameters as it goes.
+void Hogwild_CD::step(Connection *connection, int index, int t){
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   gsl_rng *rng = rngs[t];
+   gsl_vector_float_const_view ones = gsl_vector_float_const_subvector(identity, 0, batchsize);
+   
+   Input_Edge *edge = owner->inputs[0];
+   DataSet *dataset = edge->dataset;
+   Input_t *input = dataset->train;
+   bool shuffled = edge->shuffling(SAMPLE);
+   gsl_matrix_float_view rows;
+   if (!shuffled && index + batchsize <= input->size1 && dataset->direct(input))
+      rows = gsl_matrix_float_submatrix(input, index, 0, batchsize, visible->nodenum);
+   else {
+      dataset->read_rows(input, index, batchsize, shuffled ? edge->order->data : NULL, staging[t]->data);
+      rows = gsl_matrix_float_submatrix(staging[t], 0, 0, batchsize, visible->nodenum);
+   }
+   gsl_matrix_float_transpose_memcpy(v_data[t], &rows.matrix);
+   if (visible->noisy)
+      for (int i = 0; i < v_data[t]->size1; ++i)
+         for (int j = 0; j < batchsize; ++j)
+            if (gsl_rng_uniform(rng) < visible->noise) gsl_matrix_float_set(v_data[t], i, j, 0);
+   
+   gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, connection->weights, v_data[t], 0, h_exps[t]);
+   hidden->fused_activation(h_exps[t], h_exps[t], h_samples[t], rng);
+   gsl_matrix_float_memcpy(h_data[t], h_samples[t]);
+   for (int g = 0; g < k; ++g) connection->gibbs_sweep(v_samples[t], v_exps[t], h_samples[t], h_exps[t], rng);
+   
+   float rate = learning_multiplier*connection->learning_rate/(float)batchsize;
+   gsl_blas_sgemm(CblasNoTrans, CblasTrans, rate, h_data[t], v_data[t], 1, connection->weights);
+   gsl_blas_sgemm(CblasNoTrans, CblasTrans, -rate, h_exps[t], v_samples[t], 1, connection->weights);
+   
+   if (visible->learning_on) {
+      gsl_blas_sgemv(CblasNoTrans, rate, v_data[t], &ones.vector, 1, visible->biases);
+      gsl_blas_sgemv(CblasNoTrans, -rate, v_samples[t], &ones.vector, 1, visible->biases);
+   }
+   if (hidden->learning_on) {
+      gsl_blas_sgemv(CblasNoTrans, rate, h_data[t], &ones.vector, 1, hidden->biases);
+      gsl_blas_sgemv(CblasNoTrans, -rate, h_exps[t], &ones.vector, 1, hidden->biases);
+   }
+}
+
+// Weight and bias decay for a whole epoch of steps at once, (1 - decay)^steps, the same shrinkage the per
+// batch decay in Connection::update and Layer::update adds up to.  Done on one thread after the workers
+// finish, so the steps themselves stay sparse rank-k writes.
+void Hogwild_CD::decay(Connection *connection, int steps){
+   if (steps == 0) return;
+   if (connection->decay != 0) gsl_matrix_float_scale(connection->weights, powf(1 - connection->decay, steps));
+   Layer *layers[] = {connection->from, connection->to};
+   for (auto layer:layers)
+      if (layer->learning_on && layer->decay != 0) gsl_vector_float_scale(layer->biases, powf(1 - layer->decay, steps));
+}
+
+void Hogwild_CD::checkpoint_state(RBM *rbm, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters){
+   for (int t = 0; t < workers; ++t) streams.push_back(rngs[t]);
+}
+
+void Hogwild_CD::teachRBM(RBM *rbm){
+   if (rbm->edges.size() != 1 || rbm->inputs.size() != 1) {
+      ContrastiveDivergence::teachRBM(rbm);
+      return;
+   }
+   
+   Connection *connection = (Connection*)rbm->edges[0];
+   Input_Edge *edge = rbm->inputs[0];
+   DataSet *dataset = edge->dataset;
+   if (owner != rbm) init_buffers(rbm);
+   
+   learning = true;
+   learning_multiplier = 1;
+   rbm->d_flag = TRAIN;
+   times.clear();
+   costs.clear();
+   double elapsed = 0;   // Training time only, the cost evaluation isn't counted.
+   
+   int first_epoch = 0;
+   if (checkpointer != NULL && checkpointer->resuming) {
+      if (checkpointer->index != 0) std::cerr << "Hogwild resumes at epoch boundaries, restarting epoch " << checkpointer->epoch << std::endl;
+      first_epoch = checkpointer->epoch;
+      learning_multiplier = checkpointer->learning_multiplier;
+      checkpointer->index = 0;
+      checkpointer->restore(rbm, this);
+   }
+   
+   for (int epoch = first_epoch; epoch < epochs && learning; ++epoch) {
+      std::cout << std::endl << "Teaching RBM with input (hogwild, " << workers << " threads), epoch" << epoch << std::endl << "     K: " << k << std::endl << "     Batch Size: " << batchsize << std::endl << "Learning multiplier " << learning_multiplier << std::endl;
+      
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      rbm->init_data();
+      if (connection->learning_on) {
+         std::atomic<int> steps(0);
+         while (true) {
+            // Same epoch as pull_data: the batches run from where the carry leaves off, a shuffled epoch
+            // stops before a short batch and carries its rows, an ordered one wraps the last batch.
+            Input_t *input = dataset->train;
+            edge->start_epoch(input, SAMPLE);
+            int first = dataset->index, rows = (int)input->size1 - first;
+            int batches = edge->shuffling(SAMPLE) ? rows/batchsize : (rows + batchsize - 1)/batchsize;
+            cursor = 0;
+            threads->run(workers, [&](int t, int worker){
+               for (int b = cursor++; b < batches; b = cursor++) {
+                  step(connection, first + b*batchsize, t);
+                  ++steps;
+               }
+            });
+            dataset->index = first + batches*batchsize;
+            edge->end_epoch(input, SAMPLE);
+            if (!dataset->next_shard()) break;
+            edge->carry = 0;
+         }
+         decay(connection, steps);
+      }
+      dataset->index = 0;
+      elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (checkpointer != NULL) checkpointer->save(rbm, this, epoch + 1, 1, 0, learning_multiplier);
+      
+      if (timing) {
+         times.push_back(elapsed);
+         rbm->getReconstructionCost();
+         costs.push_back(rbm->reconstruction_cost);
+         std::cout << "     " << times.back() << "s, reconstruction cost " << costs.back() << std::endl;
+      }
+      if (monitor != NULL) monitor->update();
+   }
+}
+
+void Hogwild_CD::benchmark(RBM *rbm, std::vector<int> thread_counts){
+   Connection *connection = (Connection*)rbm->edges[0];
+   gsl_matrix_float *weights = gsl_matrix_float_alloc(connection->weights->size1, connection->weights->size2);
+   gsl_vector_float *v_biases = gsl_vector_float_alloc(connection->from->nodenum);
+   gsl_vector_float *h_biases = gsl_vector_float_alloc(connection->to->nodenum);
+   gsl_matrix_float_memcpy(weights, connection->weights);
+   gsl_vector_float_memcpy(v_biases, connection->from->biases);
+   gsl_vector_float_memcpy(h_biases, connection->to->biases);
+   
+   std::string filepath = context->plotpath + "hogwild_benchmark.plot";
+   std::ofstream file(filepath.c_str());
+   file << "# threads epoch seconds reconstruction_cost" << std::endl;
+   
+   bool was_timing = timing;
+   timing = true;
+   for (auto n:thread_counts) {
+      gsl_matrix_float_memcpy(connection->weights, weights);
+      gsl_vector_float_memcpy(connection->from->biases, v_biases);
+      gsl_vector_float_memcpy(connection->to->biases, h_biases);
+      set_workers(n);
+      teachRBM(rbm);
+      for (int e = 0; e < times.size(); ++e) file << n << " " << e << " " << times[e] << " " << costs[e] << std::endl;
+   }
+   timing = was_timing;
+   file.close();
+   std::cout << "Hogwild benchmark written to " << filepath << std::endl;
+   
+   gsl_matrix_float_memcpy(connection->weights, weights);
+   gsl_vector_float_memcpy(connection->from->biases, v_biases);
+   gsl_vector_float_memcpy(connection->to->biases, h_biases);
+   gsl_matrix_float_free(weights);
+   gsl_vector_float_free(v_biases);
+   gsl_vector_float_free(h_biases);
+}
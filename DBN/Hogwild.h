@@ -0,0 +1,66 @@
+//
+//  Hogwild.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Hogwild__
+#define __DBN__Hogwild__
+
+#include <iostream>
+#include <atomic>
+#include "Teacher.h"
+
+class RBM;
+class Connection;
+class Thread_Pool;
+
+/////////////////////////////////////
+// Hogwild CD
+/////////////////////////////////////
+
+// Asynchronous CD for small batches (batchsize 1 in the usual config).  Every worker claims the next batch
+// from a shared cursor over the input edge's epoch (its shuffled order if it shuffles, shard by shard for a
+// catalog, with the leftover rows carried or wrapped just as Input_Edge::pull_data does), reads the rows
+// with DataSet::read_rows if they can't be used in place, runs CD-k on its own buffers and writes its step
+// straight into the shared weights and biases without any locking.  Collisions are rare with sparse enough
+// updates, and lost ones just add a bit of noise.  There's no momentum since the momentum buffers would be
+// shared too (a nonzero one is ignored with a warning), and decay is applied once per epoch rather than as
+// a dense write on every step.  The order the workers take batches in isn't reproducible anyway, so
+// checkpoints are only taken (and resumed from) at the end of an epoch.  Single connection RBMs only,
+// others get plain CD.
+class Hogwild_CD : public ContrastiveDivergence {
+public:
+   int                              workers;
+   Thread_Pool                      *threads;       // The context's pool, or one of our own for another size.
+   bool                             owns_threads;
+   RBM                              *owner;
+   std::atomic<int>                 cursor;        // Next batch of the shard to claim.
+   
+   std::vector<gsl_rng*>            rngs;
+   std::vector<gsl_matrix_float*>   v_data, h_data, v_samples, v_exps, h_samples, h_exps;
+   std::vector<gsl_matrix_float*>   staging;      // batchsize x input columns, for rows that go through read_rows.
+   
+   // Filled by teachRBM after every epoch when timing is on: seconds since the start, reconstruction cost.
+   bool                             timing;
+   std::vector<double>              times;
+   std::vector<float>               costs;
+   
+   ~Hogwild_CD();
+   Hogwild_CD(float momentum, int k, int batchsize, int epochs, int workers = 0);
+   
+   void set_workers(int workers);
+   void init_buffers(RBM*);
+   void step(Connection*, int index, int t);
+   void decay(Connection*, int steps);
+   void teachRBM(RBM *rbm);
+   void checkpoint_state(RBM*, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters);
+   
+   // Trains from the same starting parameters once per thread count and writes reconstruction cost against
+   // wall clock to the context's plotpath/hogwild_benchmark.plot.  The RBM is left with the parameters it started with.
+   void benchmark(RBM *rbm, std::vector<int> thread_counts);
+};
+
+#endif /* defined(__DBN__Hogwild__) */
@@ -8,9 +8,64 @@
 
 #include "IO.h"
 #include "SupportFunctions.h"
+#include "Threads.h"
+#include "Preprocess.h"
+#include "Catalog.h"
+#include "Quantize.h"
 #include <H5Cpp.h>
+#include <string.h>
+#include <math.h>
+#include <functional>
+#include <sys/mman.h>
 
-void DataSet::loadMNIST(){
+Input_t *load_idx(const std::string& filename, float scale, std::vector<int> *shape){
+   Mapped_File file(filename);
+   if (file.data == NULL) {
+      std::cerr << "Could not open " << filename << std::endl;
+      return NULL;
+   }
+   
+   // Magic is two zero bytes, the element type (0x08 for unsigned bytes) and the number of dimensions,
+   // followed by each dimension as a big endian 32 bit int.
+   const uint8_t *bytes = (const uint8_t*)file.data;
+   if (file.size < 4 || bytes[0] != 0 || bytes[1] != 0 || bytes[3] == 0) {
+      std::cerr << filename << " is not an IDX file" << std::endl;
+      return NULL;
+   }
+   if (bytes[2] != 0x08) {
+      std::cerr << filename << " has IDX type " << (int)bytes[2] << ", only unsigned bytes are supported" << std::endl;
+      return NULL;
+   }
+   
+   int ndims = bytes[3];
+   size_t header = 4 + 4*ndims;
+   if (file.size < header) {
+      std::cerr << filename << " is truncated" << std::endl;
+      return NULL;
+   }
+   std::vector<int> dims;
+   size_t count = 1;
+   for (int d = 0; d < ndims; ++d) {
+      uint32_t n;
+      memcpy(&n, bytes + 4 + 4*d, sizeof(n));
+      dims.push_back((int)ntohl(n));
+      count *= dims.back();
+   }
+   if (count == 0 || file.size < header + count) {
+      std::cerr << filename << " holds " << file.size - header << " bytes, its header says " << count << std::endl;
+      return NULL;
+   }
+   
+   file.advise_sequential();
+   Input_t *m = gsl_matrix_float_alloc(dims[0], count/dims[0]);
+   u8_to_float(bytes + header, m->data, count, scale);
+   if (shape != NULL) *shape = dims;
+   return m;
+}
+
+// Images (and labels, when the label files are there) straight out of the mapped files.  A scale of
+// 1/255 puts the pixels in [0,1].
+void DataSet::loadMNIST(float scale){
    
    std::cout << "Loading MNIST" << std::endl;
    
@@ -19,64 +74,138 @@ void DataSet::loadMNIST(){
    meanImage = NULL;
    mask = NULL;
    
-   std::string trainfile = MNISTpath + "train-images.idx3-ubyte";
-   std::string testfile = MNISTpath + "t10k-images.idx3-ubyte";
-   FILE *file_handle;
-   file_handle = fopen(trainfile.c_str(), "rb");
-   
-   unsigned char pixel; 
-   uint32_t magicnumber, imageNum, rowNum, colNum;
-   
-   fread(&magicnumber, sizeof(magicnumber), 1, file_handle);
-   fread(&imageNum, sizeof(imageNum), 1, file_handle);
-   fread(&rowNum, sizeof(rowNum), 1, file_handle);
-   fread(&colNum, sizeof(colNum), 1, file_handle);
-   
-   magicnumber = ntohl(magicnumber);
-   imageNum = ntohl(imageNum);
-   rowNum = ntohl(rowNum);
-   colNum = ntohl(colNum);
-   
-   train = gsl_matrix_float_alloc(imageNum, colNum*rowNum);
-   
-   height=rowNum, width = colNum, number = imageNum;
-   
-   for (int i = 0; i < imageNum; ++i)
-      for (int j = 0; j < rowNum*colNum; ++j){
-         fread(&pixel, sizeof(pixel), 1, file_handle);
-         int val = (int)pixel;
-         gsl_matrix_float_set(train, i, j, (float)val);
-      }
-   
-   fclose(file_handle);
-   file_handle = fopen(testfile.c_str(), "rb");
+   std::vector<int> shape;
+   train = load_idx(context->MNISTpath + "train-images.idx3-ubyte", scale, &shape);
+   test = load_idx(context->MNISTpath + "t10k-images.idx3-ubyte", scale);
+   if (train == NULL || test == NULL || shape.size() != 3) {
+      std::cerr << "Could not load the MNIST images from " << context->MNISTpath << std::endl;
+      exit(EXIT_FAILURE);
+   }
+   height = shape[1], width = shape[2], number = shape[0];
+   
+   train_labels = load_idx(context->MNISTpath + "train-labels.idx1-ubyte");
+   test_labels = load_idx(context->MNISTpath + "t10k-labels.idx1-ubyte");
+   if (train_labels != NULL && train_labels->size1 != train->size1) {
+      std::cerr << "MNIST train labels don't match the images, dropping them" << std::endl;
+      gsl_matrix_float_free(train_labels);
+      train_labels = NULL;
+   }
+   if (test_labels != NULL && test_labels->size1 != test->size1) {
+      std::cerr << "MNIST test labels don't match the images, dropping them" << std::endl;
+      gsl_matrix_float_free(test_labels);
+      test_labels = NULL;
+   }
    
-   fread(&magicnumber, sizeof(magicnumber), 1, file_handle);
-   fread(&imageNum, sizeof(imageNum), 1, file_handle);
-   fread(&rowNum, sizeof(rowNum), 1, file_handle);
-   fread(&colNum, sizeof(colNum), 1, file_handle);
+   applymask = false;
    
-   magicnumber = ntohl(magicnumber);
-   imageNum = ntohl(imageNum);
-   rowNum = ntohl(rowNum);
-   colNum = ntohl(colNum);
+   std::cout << "Done loading" << std::endl;
    
-   test = gsl_matrix_float_alloc(imageNum, colNum*rowNum);
+   denorm = false;
+}
+
+// The number in a scan's file name (scan7.out -> 7), so the scans can be put in time order.
+static int scan_number(const std::string& filename){
+   size_t digit = filename.find_first_of("0123456789");
+   return (digit == std::string::npos) ? -1 : atoi(filename.c_str() + digit);
+}
+
+// Every scan file in path in scan order (readdir's order is arbitrary).  newest gets the latest mtime.
+std::vector<std::string> list_scans(const std::string& path, time_t& newest){
+   std::vector<std::pair<int, std::string> > scans;
+   newest = 0;
    
-   for (int i = 0; i < imageNum; ++i)
-      for (int j = 0; j < rowNum*colNum; ++j){
-         fread(&pixel, sizeof(pixel), 1, file_handle);
-         int val = (int)pixel;
-         gsl_matrix_float_set(test, i, j, (float)val);
-      }
+   DIR *dir = opendir(path.c_str());
+   if (dir == NULL) return std::vector<std::string>();
+   struct dirent *filep;
+   while ((filep = readdir(dir))){
+      std::string filename = filep->d_name;
+      std::string pathname = path + filename;
+      struct stat filestat;
+      
+      // If the file is a directory (or is in some way invalid) we'll skip it
+      if (stat( pathname.c_str(), &filestat )) continue;
+      if (S_ISDIR( filestat.st_mode ))         continue;
+      if (filename == ".DS_Store")             continue;
+      
+      newest = std::max(newest, filestat.st_mtime);
+      scans.push_back(std::make_pair(scan_number(filename), pathname));
+   }
+   closedir(dir);
    
+   std::sort(scans.begin(), scans.end());
+   std::vector<std::string> paths;
+   for (auto scan:scans) paths.push_back(scan.second);
+   return paths;
+}
+
+// Reads a whitespace separated text volume in one go and parses it with strtof.  Returns how many values
+// the file had (only the first size are kept), or -1 if it couldn't be read.
+static int parse_volume(const std::string& filename, float *row, int size){
+   FILE *file_handle = fopen(filename.c_str(), "rb");
+   if (file_handle == NULL) return -1;
+   fseek(file_handle, 0, SEEK_END);
+   long bytes = ftell(file_handle);
+   rewind(file_handle);
+   std::string text(bytes, '\0');
+   bool ok = fread(&text[0], 1, bytes, file_handle) == bytes;
    fclose(file_handle);
+   if (!ok) return -1;
    
-   applymask = false;
+   int count = 0;
+   const char *p = text.c_str();
+   char *end;
+   for (float value = strtof(p, &end); end != p; value = strtof(p, &end)) {
+      if (count < size) row[count] = value;
+      ++count;
+      p = end;
+   }
+   return count;
+}
+
+// Parses scans into the rows of dest, one file per task on the context's pool.  Rows without a scan are left
+// zero.  False if there weren't enough scans or any of them had the wrong number of values.
+bool parse_scans(Context *context, const std::vector<std::string>& scans, Input_t *dest){
+   int count = std::min((int)scans.size(), (int)dest->size1);
+   gsl_matrix_float_set_zero(dest);
+   
+   std::vector<int> values(count);
+   context->pool()->run(count, [&](int i, int worker){
+      values[i] = parse_volume(scans[i], dest->data + i*dest->tda, (int)dest->size2);
+   });
+   
+   bool complete = (count == dest->size1);
+   for (int i = 0; i < count; ++i) if (values[i] != dest->size2) {
+      std::cerr << scans[i] << ": expected " << dest->size2 << " values, read " << values[i] << std::endl;
+      complete = false;
+   }
+   return complete;
+}
+
+// Loads run s (fMRIdata<s>/) into dest, one scan per row.  The first time, the scans are parsed in parallel
+// and saved as a binary matrix in the cache directory; after that the cache is mapped straight in, unless a
+// scan has been touched since it was written.
+static void load_fMRI_run(Context *context, int s, Input_t *dest){
+   std::stringstream n;
+   n << s;
+   std::string path = context->fMRIpath + n.str() + "/";
+   std::string cachefile = context->cachepath + "fMRIdata" + n.str() + ".bin";
+   
+   time_t newest;
+   std::vector<std::string> scans = list_scans(path, newest);
+   struct stat cachestat;
+   if (stat(cachefile.c_str(), &cachestat) == 0 && cachestat.st_mtime >= newest && load_gsl_matrix_binary(cachefile, dest)) {
+      std::cout << "Loaded " << path << " from " << cachefile << std::endl;
+      return;
+   }
    
-   std::cout << "Done loading" << std::endl;
+   if (scans.size() != dest->size1)
+      std::cerr << "Expected " << dest->size1 << " scans in " << path << ", found " << scans.size() << std::endl;
    
-   denorm = false;
+   // Only cache a run that parsed cleanly, so a bad scan gets another look next time.
+   if (parse_scans(context, scans, dest)) {
+      mkdir(context->cachepath.c_str(), 0755);
+      save_gsl_matrix_binary(dest, cachefile);
+   }
 }
 
 void DataSet::loadfMRI(bool d1, bool d2, bool d3){
@@ -93,59 +222,19 @@ void DataSet::loadfMRI(bool d1, bool d2, bool d3){
    
    name = "fMRI";
    
-   std::string filename, pathname;
-   
-   struct dirent *filep;
-   struct stat filestat;
-   std::ifstream file;
-   DIR *dir;
    int sample = 0;
    
-   std::string path;
    extra = gsl_matrix_float_calloc(220, dims[0]*dims[1]);
    meanImage = gsl_vector_float_calloc(train->size2);
    norm = gsl_vector_float_calloc(train->size2);
    for (int s = 1; s <=3; ++s) {
       if ((s == 1 && d1) || (s == 2 && d2) || (s==3 && d3) ) {
-         
-         std::stringstream n;
-         n << s;
-         path = fMRIpath + n.str() + "/";
-         dir = opendir(path.c_str());
-         while ((filep = readdir(dir))){
-            filename = filep->d_name;
-            pathname = path + filep->d_name;
-            
-            // If the file is a directory (or is in some way invalid) we'll skip it
-            if (stat( pathname.c_str(), &filestat )) continue;
-            if (S_ISDIR( filestat.st_mode ))         continue;
-            if (filename == ".DS_Store")             continue;
-            
-            //cout << "Loading " << filename << endl;
-            
-            file.open(pathname.c_str());
-            
-            std::string line;
-            int index = 0;
-            while (getline(file, line)){
-               float value;
-               std::istringstream iss(line);
-               while (iss >> value) {
-                  gsl_matrix_float_set(extra, sample%220, index, value);
-                  ++index;
-               }
-            }
-            file.close();
-            ++sample;
-         }
-         closedir(dir);
+         load_fMRI_run(context, s, extra);
+         sample += 220;
          removeMeanImage();
          normalize();
-         for (int i = 0; i < extra->size1; ++i)
-            for (int j = 0; j < extra->size2; ++j) {
-               float val = gsl_matrix_float_get(extra, i, j);
-               gsl_matrix_float_set(train, sample-220+i, j, val);
-            }
+         gsl_matrix_float_view run = gsl_matrix_float_submatrix(train, sample-220, 0, 220, train->size2);
+         gsl_matrix_float_memcpy(&run.matrix, extra);
       }
    }
    
@@ -159,10 +248,37 @@ void DataSet::loadfMRI(bool d1, bool d2, bool d3){
    denorm = true;
 }
 
-void DataSet::load_single_3D_fMRI() {
+// Reads a [z][y][x][t] HDF5 dataset a block of time points at a time, so memory stays at one slab whatever
+// the scan length.  Each slab is handed over as voxel major, file order ((z*Y + y)*X + x)*n + k for time
+// t0 + k.
+typedef std::function<void(int t0, int n, const float *slab)> slab_job_t;
+
+static void for_each_slab(H5::DataSet& dataset, const hsize_t *dims_out, int chunk, slab_job_t job){
+   using namespace H5;
+   
+   int time = (int)dims_out[3];
+   size_t voxels = dims_out[0]*dims_out[1]*dims_out[2];
+   std::vector<float> slab(voxels*std::min(chunk, time));
+   
+   DataSpace filespace = dataset.getSpace();
+   for (int t0 = 0; t0 < time; t0 += chunk) {
+      int n = std::min(chunk, time - t0);
+      hsize_t offset[4] = {0, 0, 0, (hsize_t)t0};
+      hsize_t count[4] = {dims_out[0], dims_out[1], dims_out[2], (hsize_t)n};
+      filespace.selectHyperslab(H5S_SELECT_SET, count, offset);
+      DataSpace memspace(4, count);
+      dataset.read(slab.data(), PredType::NATIVE_FLOAT, memspace, filespace);
+      job(t0, n, slab.data());
+   }
+}
+
+// Two streaming passes over the file: the first sums each voxel over time for the mean image (and so the
+// mask), the second subtracts the mean and writes only the masked voxels, straight into train as
+// time x masked voxels.  Same result as loading everything, removing the mean image and then the mask.
+void DataSet::load_single_3D_fMRI(int slab_bytes) {
    using namespace H5;
    
-   const H5std_string   FILE_NAME(fMRI_3D_path + "out.h5");
+   const H5std_string   FILE_NAME(context->fMRI_3D_path + "out.h5");
    const H5std_string   DATASET_NAME("fMRI");
    
    
@@ -170,6 +286,10 @@ void DataSet::load_single_3D_fMRI() {
    H5::DataSet dataset = file.openDataSet(DATASET_NAME);
    
    DataSpace dataspace = dataset.getSpace();
+   if (dataspace.getSimpleExtentNdims() != 4) {
+      std::cerr << FILE_NAME << " has " << dataspace.getSimpleExtentNdims() << " dimensions, expected z, y, x, t" << std::endl;
+      exit(EXIT_FAILURE);
+   }
    hsize_t dims_out[4];
    dataspace.getSimpleExtentDims(dims_out, NULL);
    std::cout << "Dims: " << dims_out[0] << " " << dims_out[1] << " " << dims_out[2] << " " << dims_out[3] << std::endl;
@@ -179,32 +299,42 @@ void DataSet::load_single_3D_fMRI() {
    dims[2] = (int)dims_out[0];
    dims[3] = (int)dims_out[3];
    
-   //float out_buffer[(int)dims_out[0]][(int)dims_out[1]][(int)dims_out[2]][(int)dims_out[3]];
-   
+   int voxels = dims[0]*dims[1]*dims[2];
+   int time = dims[3];
+   int chunk = std::max(1, std::min(time, (int)(slab_bytes/(voxels*sizeof(float)))));
+   
+   // Voxel v = y + Y*(x + X*z) in train and the mask lives at file offset (z*Y + y)*X + x in a slab.
+   std::vector<int> file_voxel(voxels);
+   for (int z = 0; z < dims[2]; ++z)
+      for (int y = 0; y < dims[1]; ++y)
+         for (int x = 0; x < dims[0]; ++x)
+            file_voxel[y + dims[1]*(x + dims[0]*z)] = (z*dims[1] + y)*dims[0] + x;
+   
+   meanImage = gsl_vector_float_calloc(voxels);
+   std::vector<double> sums(voxels, 0);
+   for_each_slab(dataset, dims_out, chunk, [&](int t0, int n, const float *slab){
+      for (int f = 0; f < voxels; ++f)
+         for (int k = 0; k < n; ++k) sums[f] += slab[f*n + k];
+   });
+   for (int v = 0; v < voxels; ++v) gsl_vector_float_set(meanImage, v, (float)(sums[file_voxel[v]]/time));
    
-   train = gsl_matrix_float_calloc(220, dims_out[0]*dims_out[1]*dims_out[2]);
-   static float out_buffer[34][63][53][220];
-   
-   dataset.read(out_buffer, PredType::NATIVE_FLOAT);
-   
-   for (int t = 0; t < dims_out[3]; ++t) {
-      for (int z = 0; z < dims[2]; ++z) {
-         for (int y = 0; y < dims[1]; ++y) {
-            for (int x = 0; x < dims[0]; ++x) {
-               float val = out_buffer[z][y][x][t];
-               gsl_matrix_float_set(train, t, y+dims[1]*(x + dims[0]*z), val);
-            }
-         }
+   float mean = gsl_stats_float_mean(meanImage->data, meanImage->stride, meanImage->size);
+   gsl_vector_float *brain = gsl_vector_float_alloc(voxels);
+   for (int v = 0; v < voxels; ++v) gsl_vector_float_set(brain, v, gsl_vector_float_get(meanImage, v) > mean);
+   set_mask(brain);
+   const std::vector<int>& columns = mask_index->voxels;
+   
+   train = gsl_matrix_float_alloc(time, columns.size());
+   for_each_slab(dataset, dims_out, chunk, [&](int t0, int n, const float *slab){
+      for (int j = 0; j < columns.size(); ++j) {
+         const float *voxel = slab + file_voxel[columns[j]]*n;
+         float m = meanImage->data[columns[j]*meanImage->stride];
+         for (int k = 0; k < n; ++k) train->data[(t0 + k)*train->tda + j] = voxel[k] - m;
       }
-   }
+   });
+   number = time;
    
-   extra = gsl_matrix_float_alloc(train->size1, train->size2);
-   gsl_matrix_float_memcpy(extra, train);
    applymask = true;
-   removeMeanImage();
-   normalize();
-   removeMask();
-   gsl_matrix_float_free(extra);
    extra = gsl_matrix_float_alloc(train->size1, train->size2);
    gsl_matrix_float_memcpy(extra, train);
 }
@@ -221,7 +351,7 @@ void DataSet::loadSPM(){
    
    int sample = 0;
    
-   pathname = SPMpath + "SPM.dat";
+   pathname = context->SPMpath + "SPM.dat";
    
    file.open(pathname.c_str());
    
@@ -254,7 +384,7 @@ void DataSet::loadstim(){
    std::string line;
    int sample = 0;
    
-   filename = SPMpath + "l_stim.dat";
+   filename = context->SPMpath + "l_stim.dat";
    file.open(filename.c_str());
    
    while (getline(file, line)){
@@ -266,7 +396,7 @@ void DataSet::loadstim(){
    file.close();
    
    sample = 0;
-   filename = SPMpath + "r_stim.dat";
+   filename = context->SPMpath + "r_stim.dat";
    file.open(filename.c_str());
    
    while (getline(file, line)){
@@ -279,117 +409,483 @@ void DataSet::loadstim(){
    gsl_matrix_float_scale(train, 10);
 }
 
-void DataSet::removeMeanImage(){
-   
-   meanImage = gsl_vector_float_calloc(dims[0]*dims[1]*dims[2]);
-   Input_t *input = train;
+// A gsl matrix header over memory it doesn't own, so freeing it leaves the data alone.
+static Input_t *matrix_over(float *data, size_t rows, size_t cols, size_t tda){
+   Input_t *m = (Input_t*)malloc(sizeof(Input_t));
+   m->size1 = rows, m->size2 = cols, m->tda = tda;
+   m->data = data;
+   m->block = NULL;
+   m->owner = 0;
+   return m;
+}
+
+// Moves the last percentage of the training rows into validation.  A tail block rather than random rows, so
+// with fMRI the held-out scans aren't just neighbours of training ones.
+void DataSet::splitValidate(float percentage){
+   int rows = (int)train->size1;
+   int held_out = (int)(percentage*rows);
+   if (held_out <= 0 || held_out >= rows) {
+      std::cerr << "Can't hold out " << percentage << " of " << rows << " samples" << std::endl;
+      return;
+   }
    
-   float min, max;
-   gsl_matrix_float_minmax(input, &min, &max);
+   if (quantized_of(train) != NULL) {
+      std::cerr << "Can't split a quantized set, hold out the validation rows before quantizing" << std::endl;
+      return;
+   }
    
-   gsl_vector_float *sample = gsl_vector_float_alloc(input->size2);
-   gsl_vector_float_set_zero(meanImage);
-   for (int i = 0; i < input->size1; ++i){
-      gsl_matrix_float_get_row(sample, input, i);
-      gsl_vector_float_add(meanImage, sample);
+   // A mapped set is split in place, copying it out would defeat the point.
+   if (mapping_of(train) != NULL) {
+      if (validation != NULL) gsl_matrix_float_free(validation);
+      validation = matrix_over(train->data + (rows - held_out)*train->tda, held_out, train->size2, train->tda);
+      train->size1 = rows - held_out;
+      index = 0;
+      number = (int)train->size1;
+      return;
    }
    
-   gsl_vector_float_scale(meanImage, (float)1/(float)input->size1);
+   Input_t *new_train = gsl_matrix_float_alloc(rows - held_out, train->size2);
+   if (validation != NULL) gsl_matrix_float_free(validation);
+   validation = gsl_matrix_float_alloc(held_out, train->size2);
    
-   for (int i = 0; i < input->size1; ++i){
-      gsl_matrix_float_get_row(sample, input, i);
-      gsl_vector_float_sub(sample, meanImage);
-      gsl_matrix_float_set_row(input, i, sample);
-   }
+   gsl_matrix_float_view first = gsl_matrix_float_submatrix(train, 0, 0, rows - held_out, train->size2);
+   gsl_matrix_float_view last = gsl_matrix_float_submatrix(train, rows - held_out, 0, held_out, train->size2);
+   gsl_matrix_float_memcpy(new_train, &first.matrix);
+   gsl_matrix_float_memcpy(validation, &last.matrix);
+   
+   gsl_matrix_float_free(train);
+   train = new_train;
+   index = 0;
+   number = (int)train->size1;
+}
+
+// Per voxel mean over time, one pass to fit and one to subtract.  Only train is centered; if it's out of
+// core the centering goes into preprocessing and is done as its rows are read.
+void DataSet::removeMeanImage(){
+   Preprocessor *center = new Preprocessor(true, 0, false);
+   fit(center);
    
-   gsl_vector_float_free(sample);
+   if (meanImage != NULL) gsl_vector_float_free(meanImage);
+   meanImage = gsl_vector_float_alloc(center->mean->size);
+   gsl_vector_float_memcpy(meanImage, center->mean);
    
+   if (out_of_core(train)) preprocessing.push_back(center);
+   else {
+      center->apply_in_place(train);
+      delete center;
+   }
 }
 
 void DataSet::removeMask(){
    Input_t *input = train;
+   if (out_of_core(input)) {
+      std::cerr << "Can't drop masked voxels from a mapped set in place, use preprocess with a masking Preprocessor" << std::endl;
+      return;
+   }
    
    if (meanImage == NULL) {
-      meanImage = gsl_vector_float_calloc(dims[0]*dims[1]*dims[2]);
-      Input_t *input = extra;
-      
-      float min, max;
-      gsl_matrix_float_minmax(input, &min, &max);
-      
-      gsl_vector_float *sample = gsl_vector_float_alloc(input->size2);
-      gsl_vector_float_set_zero(meanImage);
-      for (int i = 0; i < input->size1; ++i){
-         gsl_matrix_float_get_row(sample, input, i);
-         gsl_vector_float_add(meanImage, sample);
-      }
-      gsl_vector_float_scale(meanImage, (float)1/(float)input->size1);
-      
-      gsl_vector_float_free(sample);
+      Preprocessor stats(true, 0, false);
+      stats.fit(extra);
+      meanImage = gsl_vector_float_alloc(stats.mean->size);
+      gsl_vector_float_memcpy(meanImage, stats.mean);
    }
    
-   int count = 0;
    float mean = gsl_stats_float_mean(meanImage->data, meanImage->stride, meanImage->size);
    
-   for (int i = 0; i < meanImage->size; ++i) count += (gsl_vector_float_get(meanImage, i) > mean);
-   
-   gsl_matrix_float *newtrain = gsl_matrix_float_alloc(input->size1, count);
+   gsl_vector_float *brain = gsl_vector_float_alloc(dims[0]*dims[1]*dims[2]);
+   for (int j = 0; j < dims[0]*dims[1]*dims[2]; ++j) gsl_vector_float_set(brain, j, gsl_vector_float_get(meanImage, j) > mean);
+   set_mask(brain);
    
-   mask = gsl_vector_float_alloc(dims[0]*dims[1]*dims[2]);
-   masksize = dims[0]*dims[1]*dims[2]-count;
-   
-   for (int j = 0; j < dims[0]*dims[1]*dims[2]; ++j){
-      float val = gsl_vector_float_get(meanImage, j);
-      if (val > mean) gsl_vector_float_set(mask, j, 1);
-      else gsl_vector_float_set(mask, j, 0);
-   }
-
-   for (int i = 0; i < dims[3]; ++i){
-      int jprime = 0;
-      for (int j = 0; j < dims[0]*dims[1]*dims[2]; ++j){
-         float maskval = gsl_vector_float_get(mask, j);
-         if (maskval == 1) {
-            float val = gsl_matrix_float_get(input, i, j);
-            gsl_matrix_float_set(newtrain, i, jprime, val);
-            ++jprime;
-         }
-      }
-   }
+   gsl_matrix_float *newtrain = gsl_matrix_float_alloc(input->size1, mask_index->size());
+   for (int i = 0; i < input->size1; ++i) mask_index->gather(input->data + i*input->tda, newtrain->data + i*newtrain->tda);
    
    gsl_matrix_float_free(input);
    train = newtrain;
 }
 
+void DataSet::set_mask(gsl_vector_float *new_mask){
+   if (mask != NULL && mask != new_mask) gsl_vector_float_free(mask);
+   if (mask_index != NULL) delete mask_index;
+   mask = new_mask;
+   mask_index = new Mask_Index(mask);
+   masksize = mask_index->volume - mask_index->size();
+}
+
+// Expands a masked vector to the full volume, WHITE outside the mask.
 void DataSet::apply_mask(gsl_vector_float *dest, gsl_vector_float *src){
    if (mask == NULL) {
       gsl_vector_float_memcpy(dest, src);
       return;
    }
    
-   for (int i = 0, iprime = 0; i < mask->size; ++i) {
-      float maskval = gsl_vector_float_get(mask, i);
-      if (maskval == 1) {
-         float val = gsl_vector_float_get(src, iprime);
-         gsl_vector_float_set(dest, i, val);
-         ++iprime;
-      }
-      else gsl_vector_float_set(dest, i, WHITE);
+   if (dest->stride == 1 && src->stride == 1) {
+      mask_index->scatter(src->data, dest->data);
+      return;
    }
+   gsl_vector_float_set_all(dest, WHITE);
+   for (int k = 0; k < mask_index->size(); ++k) gsl_vector_float_set(dest, mask_index->voxels[k], gsl_vector_float_get(src, k));
 }
 
+// Volumes go straight into a contiguous dest, which is how the feature monitors call this every update.
 void DataSet::transform_for_viz(gsl_matrix_float *dest, gsl_vector_float *src){
    if (mask == NULL) {
       load_vec_into_matrix(src, dest);
       return;
    }
+   if (dest->tda == dest->size2 && dest->size1*dest->size2 == mask_index->volume && src->stride == 1) {
+      mask_index->scatter(src->data, dest->data);
+      return;
+   }
+   if (image == NULL) image = gsl_vector_float_alloc(mask_index->volume);
    apply_mask(image, src);
    load_vec_into_matrix(image, dest);
    return;
 }
 
+//------------------------------------------------------------------------------
+
+Mask_Index::Mask_Index(gsl_vector_float *mask) : volume((int)mask->size) {
+   for (int v = 0; v < volume; ++v) {
+      if (gsl_vector_float_get(mask, v) != 1) continue;
+      if (voxels.empty() || voxels.back() != v - 1) {
+         run_voxel.push_back(v);
+         run_offset.push_back((int)voxels.size());
+         run_length.push_back(0);
+      }
+      ++run_length.back();
+      voxels.push_back(v);
+   }
+}
+
+void Mask_Index::gather(const float *full, float *compact){
+   for (int r = 0; r < run_voxel.size(); ++r)
+      memcpy(compact + run_offset[r], full + run_voxel[r], run_length[r]*sizeof(float));
+}
+
+void Mask_Index::scatter(const float *compact, float *full, float fill){
+   int v = 0;
+   for (int r = 0; r < run_voxel.size(); ++r) {
+      std::fill(full + v, full + run_voxel[r], fill);
+      memcpy(full + run_voxel[r], compact + run_offset[r], run_length[r]*sizeof(float));
+      v = run_voxel[r] + run_length[r];
+   }
+   std::fill(full + v, full + volume, fill);
+}
+
+// Standardizes extra as a whole.  The mean and variance of each row are merged into the running totals
+// (Chan et al.), so it's one pass to fit and one to apply.
 void DataSet::normalize(){
    Input_t *input = extra;
-   float mean = gsl_stats_float_mean(input->data, 1, input->size1*input->size2);
-   float sd = gsl_stats_float_sd(input->data, 1, input->size1*input->size2);
-   gsl_matrix_float_add_constant(input, -mean);
-   gsl_matrix_float_scale(input, (float)1/sd);
-}
\ No newline at end of file
+   if (out_of_core(input)) {
+      std::cerr << "Can't normalize a mapped set in place, use preprocess" << std::endl;
+      return;
+   }
+   int cols = (int)input->size2;
+   double n = 0, mean = 0, m2 = 0;
+   for (int i = 0; i < input->size1; ++i) {
+      const float *x = input->data + i*input->tda;
+      double row_mean = 0, row_m2 = 0;
+      for (int j = 0; j < cols; ++j) row_mean += x[j];
+      row_mean /= cols;
+      for (int j = 0; j < cols; ++j) row_m2 += (x[j] - row_mean)*(x[j] - row_mean);
+      
+      double delta = row_mean - mean, total = n + cols;
+      mean += delta*cols/total;
+      m2 += row_m2 + delta*delta*n*cols/total;
+      n = total;
+   }
+   
+   float offset = (float)mean, scale = (float)(1/sqrt(m2/(n - 1)));
+   for (int i = 0; i < input->size1; ++i) {
+      float *x = input->data + i*input->tda;
+      for (int j = 0; j < cols; ++j) x[j] = (x[j] - offset)*scale;
+   }
+}
+
+// Fits p on train (unless it already has been), then runs every set with train's columns through it, so
+// test, validation and extra get train's statistics.  p is kept in preprocessing for transform, and for
+// read_rows, which is where out of core sets get it.
+void DataSet::preprocess(Preprocessor *p){
+   if (p->samples == 0) fit(p);
+   int cols = p->input_size();
+   
+   Input_t **sets[] = {&train, &test, &validation, &extra};
+   for (auto set:sets) {
+      Input_t *input = *set;
+      if (input == NULL || out_of_core(input) || input->size2 != cols) continue;
+      if (p->output_size() == cols) p->apply_in_place(input);
+      else {
+         *set = p->apply(input);
+         gsl_matrix_float_free(input);
+      }
+   }
+   
+   // A mask over the already masked columns gets folded into the voxel mask, so viz still works.
+   if (p->output_size() != cols) {
+      gsl_vector_float *kept = p->make_mask();
+      if (mask == NULL) set_mask(kept);
+      else {
+         for (int k = 0; k < mask_index->size(); ++k) gsl_vector_float_set(mask, mask_index->voxels[k], gsl_vector_float_get(kept, k));
+         gsl_vector_float_free(kept);
+         set_mask(mask);
+      }
+      applymask = true;
+   }
+   
+   if (p->sigma > 0) {
+      if (norm != NULL) gsl_vector_float_free(norm);
+      norm = gsl_vector_float_alloc(p->output_size());
+      for (int c = 0; c < p->output_size(); ++c) gsl_vector_float_set(norm, c, gsl_vector_float_get(p->sd, gsl_vector_int_get(p->columns, c)));
+      denorm = true;
+   }
+   
+   number = (int)train->size1;
+   preprocessing.push_back(p);
+}
+
+// New data in the same form as this set's, e.g. for inference on a model trained on it.
+Input_t *DataSet::transform(Input_t *input){
+   Input_t *output = gsl_matrix_float_alloc(input->size1, input->size2);
+   gsl_matrix_float_memcpy(output, input);
+   for (auto p:preprocessing) {
+      Input_t *next = p->apply(output);
+      gsl_matrix_float_free(output);
+      if (next == NULL) return NULL;
+      output = next;
+   }
+   return output;
+}
+// Every training row as read_rows gives it, through every shard when train streams from a catalog.  The
+// shard that was open is opened again afterwards.
+void DataSet::for_each_train_row(std::function<void(const float *row)> visit){
+   int open = shard;
+   int count = (catalog != NULL) ? (int)shards.size() : 1;
+   std::vector<float> row;
+   for (int s = 0; s < count; ++s) {
+      if (catalog != NULL && s != shard && !open_shard(s)) continue;
+      row.resize(train->size2);
+      for (int i = 0; i < train->size1; ++i) {
+         read_rows(train, i, 1, NULL, row.data());
+         visit(row.data());
+      }
+   }
+   if (catalog != NULL && shard != open) open_shard(open);
+}
+
+// Rows in the whole training set.  Opening a shard only maps it, so counting doesn't read any data.
+int DataSet::train_rows(){
+   if (shard_count() == 1) return (int)train->size1;
+   int open = shard, total = 0;
+   for (int s = 0; s < shard_count(); ++s)
+      if (s == shard || open_shard(s)) total += (int)train->size1;
+   if (shard != open) open_shard(open);
+   return total;
+}
+
+// Evenly strided rows of the whole training set, each shard contributing its share.
+Input_t *DataSet::sample_train(int rows){
+   if (shard_count() == 1) return sample_rows(train, rows);
+   int open = shard, total = train_rows();
+   if (rows <= 0 || rows > total) rows = total;
+   
+   Input_t *sample = gsl_matrix_float_alloc(rows, train->size2);
+   int offset = 0, r = 0;
+   for (int s = 0; s < shard_count() && r < rows; ++s) {
+      if (s != shard && !open_shard(s)) continue;
+      int n = (int)train->size1;
+      for (long at = (long)r*total/rows; r < rows && at < offset + n; ++r, at = (long)r*total/rows)
+         read_rows(train, (int)(at - offset), 1, NULL, sample->data + r*sample->tda);
+      offset += n;
+   }
+   sample->size2 = columns_of(train);
+   if (shard != open) open_shard(open);
+   return sample;
+}
+
+// Fits p on the whole training set, not just the shard that happens to be open.
+void DataSet::fit(Preprocessor *p){
+   p->begin_fit(columns_of(train));
+   for_each_train_row([&](const float *x){ p->fit_row(x); });
+   p->end_fit();
+}
+
+// Smallest and largest value in train, as read.
+void DataSet::train_range(float &min, float &max){
+   if (direct(train) && (catalog == NULL || shards.size() < 2)) {
+      gsl_matrix_float_minmax(train, &min, &max);
+      return;
+   }
+   int cols = columns_of(train);
+   min = INFINITY, max = -INFINITY;
+   for_each_train_row([&](const float *x){
+      for (int j = 0; j < cols; ++j) min = std::min(min, x[j]), max = std::max(max, x[j]);
+   });
+}
+
+//------------------------------------------------------------------------------
+
+// Mapped sets without any preprocessing can be read straight out of the mapping; quantized ones never can.
+bool DataSet::direct(Input_t *input){
+   if (quantized_of(input) != NULL) return false;
+   return preprocessing.empty() || mapping_of(input) == NULL;
+}
+
+// The preprocessors that take input's columns apply in turn, each narrowing it to its output.
+int DataSet::columns_of(Input_t *input){
+   int cols = (int)input->size2;
+   if (out_of_core(input)) for (auto p:preprocessing) if (p->input_size() == cols) cols = p->output_size();
+   return cols;
+}
+
+// Rows first.. of input (wrapping past the last), or order[first..], into dest at a stride of input->size2
+// floats, so each row can be dequantized and preprocessed where it lands.  Safe to call from several
+// threads at once.
+void DataSet::read_rows(Input_t *input, int first, int count, const int *order, float *dest){
+   int n = (int)input->size1, cols = (int)input->size2;
+   Quantized_Matrix *packed = quantized_of(input);
+   std::vector<Preprocessor*> chain;
+   if (out_of_core(input)) {
+      int w = cols;
+      for (auto p:preprocessing) if (p->input_size() == w) {
+         chain.push_back(p);
+         w = p->output_size();
+      }
+   }
+   
+   for (int j = 0; j < count; ++j) {
+      int row = (order != NULL) ? order[first + j] : (first + j)%n;
+      if (j + 2 < count) {
+         int ahead = (order != NULL) ? order[first + j + 2] : (first + j + 2)%n;
+         if (packed != NULL) __builtin_prefetch(packed->row_data(ahead));
+         else __builtin_prefetch(input->data + ahead*input->tda);
+      }
+      float *x = dest + j*cols;
+      if (packed != NULL) packed->dequantize_row(row, x);
+      else memcpy(x, input->data + row*input->tda, cols*sizeof(float));
+      for (auto p:chain) p->apply_row(x, x);
+   }
+}
+
+// rows rows spread evenly over input (all of them if rows <= 0), the ones RBM::free_energy_of would take,
+// read into a new matrix.  Its tda stays input's width so the rows could be preprocessed in place.
+Input_t *DataSet::sample_rows(Input_t *input, int rows){
+   int stride = 1;
+   if (rows <= 0 || rows > input->size1) rows = (int)input->size1;
+   else stride = (int)input->size1/rows;
+   std::vector<int> picked(rows);
+   for (int i = 0; i < rows; ++i) picked[i] = i*stride;
+   
+   Input_t *sample = gsl_matrix_float_alloc(rows, input->size2);
+   read_rows(input, 0, rows, picked.data(), sample->data);
+   sample->size2 = columns_of(input);
+   return sample;
+}
+
+Input_t *DataSet::map_matrix(const std::string& filename){
+   Mapped_File *file = new Mapped_File(filename);
+   uint32_t header[3];
+   if (file->data == NULL || file->size < sizeof(header)) {
+      std::cerr << "Could not map " << filename << std::endl;
+      delete file;
+      return NULL;
+   }
+   memcpy(header, file->data, sizeof(header));
+   if (header[0] == quantized_matrix_magic) {
+      delete file;
+      Quantized_Matrix *q = new Quantized_Matrix(filename);
+      if (!q->valid()) {
+         delete q;
+         return NULL;
+      }
+      q->matrix = matrix_over(NULL, q->rows, q->cols, q->cols);
+      quantized.push_back(q);
+      std::cout << "Mapped " << q->rows << "x" << q->cols << " (" << q->bits << " bit, rms error " << q->rms_error << ") from " << filename << std::endl;
+      return q->matrix;
+   }
+   if (header[0] != binary_matrix_magic || file->size < sizeof(header) + (size_t)header[1]*header[2]*sizeof(float)) {
+      std::cerr << filename << " is not a binary matrix file" << std::endl;
+      delete file;
+      return NULL;
+   }
+   
+   mappings.push_back(file);
+   std::cout << "Mapped " << header[1] << "x" << header[2] << " from " << filename << std::endl;
+   return matrix_over((float*)(file->data + sizeof(header)), header[1], header[2], header[2]);
+}
+
+Mapped_File *DataSet::mapping_of(Input_t *input){
+   for (auto mapping:mappings) if (input != NULL && mapping->contains(input->data)) return mapping;
+   return NULL;
+}
+
+Quantized_Matrix *DataSet::quantized_of(Input_t *input){
+   for (auto q:quantized) if (input != NULL && q->matrix == input) return q;
+   return NULL;
+}
+
+// Sequential epochs get the kernel's readahead, shuffled ones turn it off since it would only read pages
+// the next batch doesn't want.
+void DataSet::advise_epoch(Input_t *input, bool shuffled){
+   if (Quantized_Matrix *q = quantized_of(input)) {
+      q->mapping()->advise(q->row_data(0), q->rows*q->row_bytes(), shuffled ? MADV_RANDOM : MADV_SEQUENTIAL);
+      return;
+   }
+   Mapped_File *mapping = mapping_of(input);
+   if (mapping == NULL) return;
+   mapping->advise(input->data, input->size1*input->tda*sizeof(float), shuffled ? MADV_RANDOM : MADV_SEQUENTIAL);
+}
+
+// Asks for the rows of a batch ahead of time: index.. of input, or order[index..] when shuffled.
+void DataSet::advise_rows(Input_t *input, int index, int rows, const int *order){
+   if (Quantized_Matrix *q = quantized_of(input)) {
+      rows = std::min(rows, q->rows - index);
+      if (rows <= 0) return;
+      if (order == NULL) q->mapping()->advise(q->row_data(index), rows*q->row_bytes(), MADV_WILLNEED);
+      else for (int j = 0; j < rows; ++j) q->mapping()->advise(q->row_data(order[index + j]), q->row_bytes(), MADV_WILLNEED);
+      return;
+   }
+   Mapped_File *mapping = mapping_of(input);
+   if (mapping == NULL) return;
+   rows = std::min(rows, (int)input->size1 - index);
+   if (rows <= 0) return;
+   size_t row_bytes = input->size2*sizeof(float);
+   if (order == NULL) {
+      mapping->advise(input->data + index*input->tda, (rows - 1)*input->tda*sizeof(float) + row_bytes, MADV_WILLNEED);
+      return;
+   }
+   for (int j = 0; j < rows; ++j) mapping->advise(input->data + order[index + j]*input->tda, row_bytes, MADV_WILLNEED);
+}
+
+//------------------------------------------------------------------------------
+
+// Swaps train for shard s's cache, unmapping the one before.  The cache is raw; preprocessing reaches it
+// through read_rows like any other mapped set.
+bool DataSet::open_shard(int s){
+   Mapped_File *old = mapping_of(train);
+   Quantized_Matrix *old_quantized = quantized_of(train);
+   Input_t *next = map_matrix(catalog->entries[shards[s]].cachefile);
+   if (next == NULL) return false;
+   
+   if (train != NULL) gsl_matrix_float_free(train);
+   if (old != NULL) {
+      mappings.erase(std::find(mappings.begin(), mappings.end(), old));
+      delete old;
+   }
+   if (old_quantized != NULL) {
+      quantized.erase(std::find(quantized.begin(), quantized.end(), old_quantized));
+      delete old_quantized;
+   }
+   train = next;
+   shard = s;
+   index = 0;
+   number = (int)train->size1;
+   return true;
+}
+
+// Moves on to the next shard and returns true, or rewinds to the first for the next epoch and returns false.
+bool DataSet::next_shard(){
+   if (catalog == NULL || shards.size() < 2) return false;
+   if (shard + 1 < shards.size()) return open_shard(shard + 1);
+   open_shard(0);
+   return false;
+}
@@ -9,16 +9,51 @@
 #ifndef DBN_IO_h
 #define DBN_IO_h
 #include "Types.h"
+#include "Context.h"
 #include <stdint.h>
 #include <arpa/inet.h>
+#include <functional>
 
 class Layer;
 
+// Reads an IDX file (the MNIST format) of unsigned bytes into a matrix with one row per entry of the
+// first dimension, multiplied by scale on the way in.  Labels come back as a single column.  shape gets the
+// dimensions from the header if it's given.  NULL if the file is missing or isn't a valid u8 IDX file.
+Input_t *load_idx(const std::string& filename, float scale = 1, std::vector<int> *shape = NULL);
+
+// Text scan directories (one whitespace separated volume per file).
+std::vector<std::string> list_scans(const std::string& path, time_t& newest);
+bool parse_scans(Context *context, const std::vector<std::string>& scans, Input_t *dest);
+
+class Mapped_File;
+class Preprocessor;
+class Data_Catalog;
+class Quantized_Matrix;
+
+// A brain mask as the sorted list of voxels it keeps, also stored as runs of consecutive voxels.  Masks
+// are mostly long runs along a row, so compacting a volume (gather) or expanding one back for display
+// (scatter) is a memcpy per run rather than a test per voxel.
+class Mask_Index {
+public:
+   int                  volume;        // Voxels in the full volume
+   std::vector<int>     voxels;        // Kept voxels, ascending
+   
+   Mask_Index(gsl_vector_float *mask);
+   
+   int size() {return (int)voxels.size();}
+   void gather(const float *full, float *compact);
+   void scatter(const float *compact, float *full, float fill = WHITE);
+   
+private:
+   std::vector<int>     run_voxel, run_offset, run_length;
+};
+
 class DataSet{
 public:
    std::string name;
    int height, width, number, masksize, index;
    Input_t *train, *test, *validation, *extra;
+   Input_t *train_labels, *test_labels;               // One column of class indices, if the set has them
    
    int dims[4];
    
@@ -27,12 +62,40 @@ public:
    
    gsl_vector_float *meanImage;
    gsl_vector_float *mask;
+   Mask_Index       *mask_index;                      // Made by set_mask, NULL with no mask
    gsl_vector_float *image;
    gsl_vector_float *norm;
    
-   DataSet(){
+   Context          *context;                         // Where the data directories live
+   
+   // Out of core storage.  Matrices from map_matrix point straight into a read-only mapping of a binary
+   // matrix file, so the kernel pages rows in as the sampler touches them and drops them again under memory
+   // pressure.  Nothing is ever written to them: preprocess leaves out of core sets alone and read_rows
+   // runs their rows through preprocessing on the way out instead.
+   std::vector<Mapped_File*> mappings;
+   // Quantized files (save_quantized) are mapped the same way, but what map_matrix returns for one is only a
+   // shape: its rows are read by dequantizing them in read_rows, or all at once with dequantize.
+   std::vector<Quantized_Matrix*> quantized;
+   
+   std::vector<Preprocessor*> preprocessing;          // Everything preprocess has applied, in order
+   
+   // Streaming from a catalog: train is one entry's mapped cache at a time, and an epoch runs through every
+   // entry in shards before it ends.  fit and train_range read every shard, so the statistics are the whole
+   // set's and the same preprocessing holds for each.
+   Data_Catalog     *catalog;
+   std::vector<int> shards;
+   int              shard;
+   
+   DataSet(Context *c = NULL){
+      context = (c == NULL) ? Context::default_context() : c;
+      train = test = extra = NULL;
       masksize = 0, height = 1, width = 1;
       mask = NULL;
+      mask_index = NULL;
+      catalog = NULL;
+      shard = 0;
+      validation = NULL;
+      train_labels = test_labels = NULL;
       meanImage = NULL;
       image = NULL;
       norm = NULL;
@@ -40,18 +103,39 @@ public:
       denorm = false;
    }
    
-   void loadMNIST();
+   void loadMNIST(float scale = 1);
+   Input_t *map_matrix(const std::string& filename);    // Train/test/extra backed by a save_gsl_matrix_binary file
+   Mapped_File *mapping_of(Input_t *input);             // NULL if input is in memory
+   Quantized_Matrix *quantized_of(Input_t *input);      // NULL unless input came from a quantized file
+   bool out_of_core(Input_t *input) {return mapping_of(input) != NULL || quantized_of(input) != NULL;}
+   bool direct(Input_t *input);                         // input->data holds its rows as read_rows gives them
+   int columns_of(Input_t *input);                      // Columns of input's rows once read
+   void read_rows(Input_t *input, int first, int count, const int *order, float *dest);
+   Input_t *sample_rows(Input_t *input, int rows);
+   void fit(Preprocessor *p);
+   void train_range(float &min, float &max);
+   void advise_epoch(Input_t *input, bool shuffled);
+   void advise_rows(Input_t *input, int index, int rows, const int *order);
+   bool open_shard(int s);
+   bool next_shard();
+   int shard_count() {return (catalog != NULL && shards.size() > 1) ? (int)shards.size() : 1;}
+   int train_rows();                                    // Across every shard
+   Input_t *sample_train(int rows);                     // sample_rows across every shard
+   void for_each_train_row(std::function<void(const float *row)> visit);
    void loadfMRI(bool,bool,bool);
-   void load_single_3D_fMRI();
+   void load_single_3D_fMRI(int slab_bytes = 64 << 20);   // Reads this much of the scan at a time
    void loadSPM();
    void loadstim();
    void splitValidate(float percentage = .1);
    void removeMeanImage();
    void getMask();
    void removeMask();
+   void set_mask(gsl_vector_float *new_mask);
    void transform_for_viz(gsl_matrix_float *dest, gsl_vector_float *src);
    void apply_mask(gsl_vector_float *dest, gsl_vector_float *src);
    void normalize();
+   void preprocess(Preprocessor *p);
+   Input_t *transform(Input_t *input);
 };
 
 
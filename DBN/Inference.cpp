@@ -0,0 +1,115 @@
+//
+//  Inference.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include "Inference.h"
+#include "MLP.h"
+#include "Connections.h"
+#include "Layers.h"
+#include "Threads.h"
+
+Inference_Engine::Inference_Engine(MLP *mlp, Layer *top, int chunk_size, Thread_Pool *thread_pool) : chunk(chunk_size) {
+   
+   // The bottom is wherever the data comes in, or failing that the first layer nothing leads to.
+   bottom = NULL;
+   if (mlp->inputs.size() != 0) bottom = mlp->inputs[0]->to;
+   else for (auto edge:mlp->edges) {
+      MLP::Leads_to leads_to_from(edge->from);
+      if (std::find_if(mlp->edges.begin(), mlp->edges.end(), leads_to_from) == mlp->edges.end()) {
+         bottom = edge->from;
+         break;
+      }
+   }
+   
+   Layer *current = bottom;
+   while (current != NULL && current != top) {
+      MLP::Comes_from comes_from_current(current);
+      MLP::edge_list_iter_t edge = std::find_if(mlp->edges.begin(), mlp->edges.end(), comes_from_current);
+      if (edge == mlp->edges.end()) {
+         std::cerr << "Inference engine: no path from the input to the requested layer" << std::endl;
+         stages.clear();
+         break;
+      }
+      Stage stage;
+      stage.connection = (Connection*)(*edge);
+      stage.layer = (*edge)->to;
+      stages.push_back(stage);
+      current = stage.layer;
+   }
+   
+   pool = (thread_pool != NULL) ? thread_pool : mlp->context->pool();
+   
+   buffers.resize(pool->size());
+   for (auto &worker_buffers:buffers) {
+      worker_buffers.push_back(gsl_matrix_float_alloc(bottom->nodenum, chunk));
+      for (auto stage:stages) worker_buffers.push_back(gsl_matrix_float_alloc(stage.layer->nodenum, chunk));
+   }
+}
+
+Inference_Engine::~Inference_Engine(){
+   for (auto &worker_buffers:buffers)
+      for (auto buffer:worker_buffers) gsl_matrix_float_free(buffer);
+}
+
+int Inference_Engine::output_size(){
+   if (stages.size() == 0) return bottom->nodenum;
+   return stages.back().layer->nodenum;
+}
+
+gsl_matrix_float *Inference_Engine::extract(Input_t *in){
+   gsl_matrix_float *out = gsl_matrix_float_alloc(in->size1, output_size());
+   extract(in, out);
+   return out;
+}
+
+// out is samples x output_size(), same row order as in.
+void Inference_Engine::extract(Input_t *in, gsl_matrix_float *out){
+   int rows = (int)in->size1;
+   int tasks = (rows + chunk - 1)/chunk;
+   pool->run(tasks, [&](int task, int worker) {
+      int start = task*chunk;
+      run_chunk(in, NULL, out, start, std::min(chunk, rows - start), worker);
+   });
+}
+
+// Every stage's activations in one pass: levels[s] is samples x stages[s].layer->nodenum, or NULL if that
+// stage isn't wanted.
+void Inference_Engine::extract_levels(Input_t *in, std::vector<gsl_matrix_float*>& levels){
+   if (levels.size() != stages.size()) {
+      std::cerr << "Inference engine: " << levels.size() << " outputs for " << stages.size() << " stages" << std::endl;
+      return;
+   }
+   int rows = (int)in->size1;
+   int tasks = (rows + chunk - 1)/chunk;
+   pool->run(tasks, [&](int task, int worker) {
+      int start = task*chunk;
+      run_chunk(in, levels.data(), NULL, start, std::min(chunk, rows - start), worker);
+   });
+}
+
+void Inference_Engine::run_chunk(Input_t *in, gsl_matrix_float **levels, gsl_matrix_float *out, int start, int n, int worker){
+   std::vector<gsl_matrix_float*> &buffer = buffers[worker];
+   
+   gsl_matrix_float_view rows_in = gsl_matrix_float_submatrix(in, start, 0, n, in->size2);
+   gsl_matrix_float_view signal = gsl_matrix_float_submatrix(buffer[0], 0, 0, buffer[0]->size1, n);
+   gsl_matrix_float_transpose_memcpy(&signal.matrix, &rows_in.matrix);
+   
+   for (int s = 0; s < stages.size(); ++s) {
+      gsl_matrix_float_view next = gsl_matrix_float_submatrix(buffer[s+1], 0, 0, buffer[s+1]->size1, n);
+      gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, stages[s].connection->weights, &signal.matrix, 0, &next.matrix);
+      stages[s].layer->fused_activation(&next.matrix, &next.matrix, NULL, NULL);
+      signal = next;
+      if (levels != NULL && levels[s] != NULL) {
+         gsl_matrix_float_view level_out = gsl_matrix_float_submatrix(levels[s], start, 0, n, levels[s]->size2);
+         gsl_matrix_float_transpose_memcpy(&level_out.matrix, &signal.matrix);
+      }
+   }
+   
+   if (out == NULL) return;
+   gsl_matrix_float_view rows_out = gsl_matrix_float_submatrix(out, start, 0, n, out->size2);
+   gsl_matrix_float_transpose_memcpy(&rows_out.matrix, &signal.matrix);
+}
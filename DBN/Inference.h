@@ -0,0 +1,57 @@
+//
+//  Inference.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Inference__
+#define __DBN__Inference__
+
+#include <iostream>
+#include "Types.h"
+
+class MLP;
+class Layer;
+class Connection;
+class Thread_Pool;
+
+/////////////////////////////////////
+// Inference engine
+/////////////////////////////////////
+
+// Mean field feature extraction for a trained stack.  The path from the data up to top is compiled once
+// into a flat list of stages (GEMM, then the fused bias + activation of the layer above), and every worker
+// gets its own preallocated buffers for each stage.  extract splits the samples into chunks across the
+// workers; there's no sampling, noise, status flags or allocation on the way.  The weights are read in
+// place, so don't keep training the model while the engine is running.
+class Inference_Engine {
+public:
+   
+   struct Stage {
+      Connection                    *connection;
+      Layer                         *layer;
+   };
+   
+   std::vector<Stage>               stages;
+   Layer                            *bottom;
+   int                              chunk;
+   
+   Thread_Pool                      *pool;          // The MLP's context pool unless one is given.
+   
+   std::vector< std::vector<gsl_matrix_float*> > buffers;   // [worker][stage], stage 0 holds the input chunk
+   
+   Inference_Engine(MLP *mlp, Layer *top, int chunk = 256, Thread_Pool *pool = NULL);
+   ~Inference_Engine();
+   
+   int output_size();
+   void extract(Input_t *in, gsl_matrix_float *out);
+   gsl_matrix_float *extract(Input_t *in);
+   void extract_levels(Input_t *in, std::vector<gsl_matrix_float*>& levels);
+   
+private:
+   void run_chunk(Input_t *in, gsl_matrix_float **levels, gsl_matrix_float *out, int start, int n, int worker);
+};
+
+#endif /* defined(__DBN__Inference__) */
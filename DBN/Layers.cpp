@@ -9,22 +9,23 @@
 #include <iostream>
 #include "Layers.h"
 
-Layer::Layer(int nodenum) : LearningUnit(), nodenum(nodenum), batchsize(1), energy(0), noisy(true) {
+Layer::Layer(int nodenum, Context *c) : LearningUnit(), nodenum(nodenum), batchsize(1), energy(0), noisy(true) {
+   context = (c == NULL) ? Context::default_context() : c;
    learning_on = true;
-   activations = gsl_matrix_float_calloc(nodenum, batchsize);
-   expectations = gsl_matrix_float_calloc(nodenum, batchsize);
-   samples = gsl_matrix_float_calloc(nodenum, batchsize);
-   batchbiases = gsl_matrix_float_alloc(nodenum, batchsize);
+   activations = context->calloc_matrix(nodenum, batchsize);
+   expectations = context->calloc_matrix(nodenum, batchsize);
+   samples = context->calloc_matrix(nodenum, batchsize);
+   batchbiases = context->alloc_matrix(nodenum, batchsize);
    
    m_factor = gsl_vector_float_alloc(nodenum);
    sample_vector = gsl_vector_float_alloc(nodenum);
    gsl_vector_float_set_all(m_factor, 1);
    
    vec_update = gsl_vector_float_calloc(nodenum);
-   mat_update = gsl_matrix_float_calloc(nodenum, batchsize);
-   stat1 = gsl_matrix_float_alloc(nodenum, batchsize);
-   stat2 = gsl_matrix_float_alloc(nodenum, batchsize);
-   extra = gsl_matrix_float_alloc(nodenum, batchsize);
+   mat_update = context->calloc_matrix(nodenum, batchsize);
+   stat1 = context->alloc_matrix(nodenum, batchsize);
+   stat2 = context->alloc_matrix(nodenum, batchsize);
+   extra = context->alloc_matrix(nodenum, batchsize);
 }
 
 void Layer::make_batch(int bs){
@@ -40,24 +41,27 @@ void Layer::make_batch(int bs){
    gsl_matrix_float_free(stat2);
    gsl_matrix_float_free(extra);
    
-   activations = gsl_matrix_float_calloc(nodenum, batchsize);
-   expectations = gsl_matrix_float_calloc(nodenum, batchsize);
-   samples = gsl_matrix_float_calloc(nodenum, batchsize);
-   batchbiases = gsl_matrix_float_calloc(nodenum, batchsize);
-   stat1 = gsl_matrix_float_calloc(nodenum, batchsize);
-   stat2 = gsl_matrix_float_calloc(nodenum, batchsize);
-   extra = gsl_matrix_float_calloc(nodenum, batchsize);
+   activations = context->calloc_matrix(nodenum, batchsize);
+   expectations = context->calloc_matrix(nodenum, batchsize);
+   samples = context->calloc_matrix(nodenum, batchsize);
+   batchbiases = context->calloc_matrix(nodenum, batchsize);
+   stat1 = context->calloc_matrix(nodenum, batchsize);
+   stat2 = context->calloc_matrix(nodenum, batchsize);
+   extra = context->calloc_matrix(nodenum, batchsize);
 }
 
 void Layer::expandBiases(){
    for (int j = 0; j < batchsize; ++j) gsl_matrix_float_set_col(batchbiases, j, biases);
 }
 
+void Layer::unit_energy(gsl_matrix_float *states, gsl_vector_float *energy){
+   gsl_blas_sgemv(CblasTrans, -1, states, biases, 1, energy);
+}
 
 void Layer::apply_noise(){
    for (int i = 0; i < nodenum; ++i)
       for (int j = 0; j < batchsize; ++j) {
-         float u = gsl_rng_uniform(r);
+         float u = gsl_rng_uniform(context->rng);
          float val = gsl_matrix_float_get(samples, i, j);
          gsl_matrix_float_set(samples, i, j, val * (u >= noise));
       }
@@ -80,9 +84,14 @@ void Layer::finish_activation(Sample_flag_t s_flag){
 void Layer::update(ContrastiveDivergence *teacher){
    if (!learning_on) return;
    gsl_vector_float *bias_update = vec_update;
-   float rate = teacher->learning_multiplier*learning_rate/(float)teacher->batchsize;
-   gsl_blas_sgemv(CblasNoTrans, rate, stat1, teacher->identity, teacher->momentum, bias_update);
-   gsl_blas_sgemv(CblasNoTrans, -rate, stat2, teacher->identity, 1, bias_update);
+   float rate = teacher->learning_multiplier*learning_rate;
+   
+   // The negative stats don't have to come from as many samples as the positive ones (persistent chains),
+   // so each side is averaged over its own columns.
+   gsl_vector_float_const_view pos_ones = gsl_vector_float_const_subvector(teacher->identity, 0, stat1->size2);
+   gsl_vector_float_const_view neg_ones = gsl_vector_float_const_subvector(teacher->identity, 0, stat2->size2);
+   gsl_blas_sgemv(CblasNoTrans, rate/(float)stat1->size2, stat1, &pos_ones.vector, teacher->momentum, bias_update);
+   gsl_blas_sgemv(CblasNoTrans, -rate/(float)stat2->size2, stat2, &neg_ones.vector, 1, bias_update);
    gsl_vector_float *decay_term = gsl_vector_float_alloc(nodenum);
    gsl_vector_float_memcpy(decay_term, biases);
    gsl_vector_float_scale(decay_term, decay);
@@ -91,6 +100,15 @@ void Layer::update(ContrastiveDivergence *teacher){
    gsl_vector_float_free(decay_term);
 }
 
+void Layer::apply_gradient(ContrastiveDivergence *teacher, gsl_vector_float *gradient, int n){
+   if (!learning_on) return;
+   float rate = teacher->learning_multiplier*learning_rate;
+   gsl_vector_float_scale(vec_update, teacher->momentum);
+   gsl_blas_saxpy(rate/(float)n, gradient, vec_update);
+   gsl_vector_float_scale(biases, 1 - decay);
+   gsl_vector_float_add(biases, vec_update);
+}
+
 void Layer::catch_stats(Stat_flag_t stat, Sample_flag_t sample){
    gsl_matrix_float *s;
    if (sample == SAMPLE) s = samples;
@@ -50,11 +50,13 @@ public:
    float                energy;                       // Energy of the layer *TODO*
    float                reconstruction_cost;
    
+   Context              *context;                     // Source of the rng for sampling and initialization
+   
    // CONSTRUCTORS ---------------------------------------------------------------------------------
    
    ~Layer(){};
-   Layer(){};
-   Layer(int n);                                   // Constructor for the Layer
+   Layer() : context(Context::default_context()) {};
+   Layer(int n, Context *context = NULL);          // Constructor for the Layer
    
    // Unit Functions------------
    void finish_activation(Sample_flag_t);
@@ -63,6 +65,12 @@ public:
    virtual void sample() = 0;         // Begin sampling.  If sample flag is on, calculate the samples, set samples to the expectation.
    virtual void getExpectations() = 0;             // Find the expectated values for the layer
    
+   // Fused bias + activation (+ sample + noise) for samplers and inference that run on their own nodenum x n
+   // buffers instead of the batch matrices.  x holds the summed input from the connections; the energy is
+   // scaled by beta for tempering.  exps may be x, samples are skipped if samps is NULL.  Only reads the
+   // layer parameters, so it can run on several threads at once as long as each has its own rng.
+   virtual void fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta = 1) = 0;
+   
    // Structure Functions------------
    virtual void make_batch(int batchsize);          // Changes all of the unit matrices into matrices of size
                                                    // nodenum_ x batchsize_
@@ -72,11 +80,23 @@ public:
    // Energy Functions-------------
    virtual float reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_float *modelMat) = 0;
    virtual void getEnergy() = 0;
-   virtual float freeEnergy_contibution() = 0;
+   // Adds this layer's side of the free energy, -log sum_h exp(h.(x + b)), to energy for each column of x,
+   // where x is the summed input from the connections (no bias).  Constant terms are dropped.
+   virtual void freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy) = 0;
+   
+   // log of the sum (or integral) over the layer's states of exp(-unit_energy + s.x), i.e. the layer's
+   // partition function given input x from the connections (nodenum long, no connections if NULL).  The base
+   // model for AIS and the visible side of exact enumeration.
+   virtual double log_partition(const double *x = NULL) = 0;
+   
+   // Adds this layer's own (non-interaction) term of the joint energy for each column of states to energy,
+   // -b.s by default.
+   virtual void unit_energy(gsl_matrix_float *states, gsl_vector_float *energy);
    
    // Update Functions-------------
    void catch_stats(Stat_flag_t, Sample_flag_t);
    virtual void update(ContrastiveDivergence*);
+   void apply_gradient(ContrastiveDivergence*, gsl_vector_float *gradient, int n);   // Same step as update, from a summed (pos - neg) gradient over n samples.
 };
 
 /////////////////////////////////////
@@ -86,7 +106,7 @@ public:
 class SigmoidLayer : public Layer {
 public:
    
-   SigmoidLayer(int n) : Layer(n){
+   SigmoidLayer(int n, Context *context = NULL) : Layer(n, context){
       noise = 0.5;
       biases = gsl_vector_float_alloc(nodenum);
       gsl_vector_float_set_all(biases, 0); // This is to force sparsity in simple cases.  Set to some negative number.  Good for analysis
@@ -94,11 +114,13 @@ public:
    
    void sample();
    void getExpectations();
+   void fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta = 1);
    void shapeInput(DataSet *data);
    
    float reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_float *modelMat);
    void getEnergy(){}
-   float freeEnergy_contibution();
+   void freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy);
+   double log_partition(const double *x = NULL);
    
    void update(ContrastiveDivergence*);
    
@@ -109,18 +131,20 @@ public:
 
 class ReLULayer : public Layer {
 public:
-   ReLULayer(int n) : Layer(n){
+   ReLULayer(int n, Context *context = NULL) : Layer(n, context){
       noise = 0.5;
       biases = gsl_vector_float_calloc(nodenum);
    }
    
    void sample();
    void getExpectations();
+   void fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta = 1);
    void shapeInput(DataSet* data);
    
    float reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_float *modelMat);
    void getEnergy(){}
-   float freeEnergy_contibution();
+   void freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy);
+   double log_partition(const double *x = NULL);
    
    void update(ContrastiveDivergence*);
 };
@@ -134,13 +158,14 @@ public:
    
    float setsigma;
    
-   GaussianLayer(int n);
+   GaussianLayer(int n, Context *context = NULL);
    
    gsl_vector_float *quad_coefficients;
    gsl_vector_float *sigmas;
    
    void sample();
    void getExpectations();
+   void fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta = 1);
    void getSigmas();
    void shapeInput(DataSet *data);
    
@@ -148,7 +173,9 @@ public:
    
    float reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_float *modelMat);
    void getEnergy(){}
-   float freeEnergy_contibution(){ return 0;}
+   void freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy);
+   double log_partition(const double *x = NULL);
+   void unit_energy(gsl_matrix_float *states, gsl_vector_float *energy);
    
    void update(ContrastiveDivergence*);
 };
@@ -160,18 +187,20 @@ public:
 class SoftmaxLayer : public Layer {
 public:
    
-   SoftmaxLayer(int n) : Layer(n) {
+   SoftmaxLayer(int n, Context *context = NULL) : Layer(n, context) {
       noise = 0.5;
       biases = gsl_vector_float_calloc(nodenum); //Maybe .5?
    }
    
    void sample();
    void getExpectations();
+   void fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta = 1);
    void shapeInput(DataSet *data);
    
    float reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_float *modelMat);
    void getEnergy(){}
-   float freeEnergy_contibution();
+   void freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy);
+   double log_partition(const double *x = NULL);
    
    void update(ContrastiveDivergence*);
 };
@@ -6,6 +6,8 @@
 //
 //
 
+#include <string.h>
+#include <typeinfo>
 #include "MLP.h"
 #include "Connections.h"
 #include "IO.h"
@@ -13,12 +15,38 @@
 #include "SupportFunctions.h"
 #include "Layers.h"
 #include "RBM.h"
+#include "MemoryPlanner.h"
+#include "Prefetch.h"
+#include "Quantize.h"
+#include "Preprocess.h"
 
 Input_Edge::Input_Edge(DataSet *ds, Layer* to_layer){
    to = to_layer;
    from = NULL;
    dataset = ds;
    input_matrix = gsl_matrix_float_calloc(dataset->height, dataset->width);
+   prefetcher = NULL;
+   shuffle = false;
+   order = NULL;
+   carry = 0;
+   gather_buffer = NULL;
+   gather_size = 0;
+}
+
+// The prefetcher joins its thread when it's deleted, so that has to happen before the edge goes.
+Input_Edge::~Input_Edge(){
+   set_prefetch(false);
+   free(gather_buffer);
+   if (order != NULL) gsl_vector_int_free(order);
+   gsl_matrix_float_free(input_matrix);
+}
+
+void Input_Edge::set_prefetch(bool on){
+   if (on && prefetcher == NULL) prefetcher = new Batch_Prefetcher(this);
+   else if (!on && prefetcher != NULL) {
+      delete prefetcher;
+      prefetcher = NULL;
+   }
 }
 
 int Input_Edge::transmit_signal(Sample_flag_t sample_flag){
@@ -35,14 +63,25 @@ int Input_Edge::pull_data(Sample_flag_t s_flag){
    else if (d_flag == TEST)         input = dataset->test;
    else if (d_flag == TIMECOURSE)   input = dataset->extra;
    
-   if (dataset->index + to->batchsize > input->size1) {
-      dataset->index = 0;
-      to->status = SAMPLED;
+   int pulled = (prefetcher != NULL) ? prefetcher->next(input, s_flag) : pull_batch(input, s_flag);
+   
+   // A set streamed from a catalog only ends the epoch after its last shard.  Leftover rows don't carry
+   // between shards since the row numbers mean different scans.
+   if (!pulled && d_flag == TRAIN && dataset->next_shard()) {
+      carry = 0;
+      return pull_data(s_flag);
+   }
+   return pulled;
+}
+
+int Input_Edge::pull_batch(Input_t *input, Sample_flag_t s_flag){
+   start_epoch(input, s_flag);
+   if (epoch_over(input, dataset->index, s_flag)) {
+      end_epoch(input, s_flag);
       return 0;
    }
    
-   gsl_matrix_float_view databatch = gsl_matrix_float_submatrix(input, dataset->index, 0, to->batchsize, to->nodenum);
-   gsl_matrix_float_transpose_memcpy(to->samples, &(databatch.matrix));
+   gather(input, dataset->index, to->samples, shuffling(s_flag));
    
    if (to->noisy && s_flag == SAMPLE) to->apply_noise();
    
@@ -51,6 +90,73 @@ int Input_Edge::pull_data(Sample_flag_t s_flag){
    return 1;
 }
 
+// Training epochs never drop the last partial batch.  Shuffled ones end when a whole batch doesn't fit and
+// carry the rest to the next permutation; ordered ones end once every row has been read, the last batch
+// wrapping around to the first rows.  Other passes (evaluation, propagation) size their batches to the data.
+bool Input_Edge::epoch_over(Input_t *input, int index, Sample_flag_t s_flag){
+   if (training(s_flag) && !shuffle) return index >= input->size1;
+   return index + to->batchsize > input->size1;
+}
+
+// New permutation at the start of a shuffled epoch, with last epoch's leftovers first.  An ordered epoch
+// starts after the rows the last one wrapped around to, so each row is read once per pass over the data.
+void Input_Edge::start_epoch(Input_t *input, Sample_flag_t s_flag){
+   if (dataset->index != 0) return;
+   dataset->advise_epoch(input, shuffling(s_flag));
+   if (!shuffling(s_flag)) {
+      if (training(s_flag)) dataset->index = carry;
+      carry = 0;
+      return;
+   }
+   int n = (int)input->size1;
+   if (order == NULL || order->size != n) {
+      if (order != NULL) gsl_vector_int_free(order);
+      order = makeShuffleList(n, to->context->rng);
+      carry = 0;
+      return;
+   }
+   std::rotate(order->data, order->data + n - carry, order->data + n);
+   gsl_ran_shuffle(to->context->rng, order->data + carry, n - carry, sizeof(int));
+   carry = 0;
+}
+
+void Input_Edge::end_epoch(Input_t *input, Sample_flag_t s_flag){
+   int n = (int)input->size1;
+   if (shuffling(s_flag)) carry = n - dataset->index;
+   else if (training(s_flag)) carry = (n > 0) ? (dataset->index - n)%n : 0;
+   dataset->index = 0;
+   to->status = SAMPLED;
+}
+
+// Fills dest (nodenum x batch) with rows index.. of input (wrapping past the last row), or with the rows
+// order[index..] when shuffled.  If the input is mapped, the next batch's rows are requested from the
+// kernel while this one trains.  Rows that can't be transposed straight out of input (quantized, or mapped
+// with preprocessing to apply) go through DataSet::read_rows into the gather buffer first.
+void Input_Edge::gather(Input_t *input, int index, gsl_matrix_float *dest, bool shuffled){
+   int rows = (int)dest->size2, cols = (int)dest->size1, n = (int)input->size1, stride = (int)input->size2;
+   dataset->advise_rows(input, index + rows, rows, shuffled ? order->data : NULL);
+   if (!shuffled && index + rows <= n && dataset->direct(input)) {
+      gsl_matrix_float_view databatch = gsl_matrix_float_submatrix(input, index, 0, rows, cols);
+      gsl_matrix_float_transpose_memcpy(dest, &(databatch.matrix));
+      return;
+   }
+   
+   if (gather_size < rows*stride) {
+      free(gather_buffer);
+      void *buffer;
+      if (posix_memalign(&buffer, 64, rows*stride*sizeof(float)) != 0) {
+         std::cerr << "Could not allocate the gather buffer" << std::endl;
+         exit(EXIT_FAILURE);
+      }
+      gather_buffer = (float*)buffer;
+      gather_size = rows*stride;
+   }
+   
+   dataset->read_rows(input, index, rows, shuffled ? order->data : NULL, gather_buffer);
+   gsl_matrix_float_view batch = gsl_matrix_float_view_array_with_tda(gather_buffer, rows, cols, stride);
+   gsl_matrix_float_transpose_memcpy(dest, &batch.matrix);
+}
+
 void Input_Edge::pull_model(){
    //  dataset->transform_for_viz(input_matrix, to->samples);
 }
@@ -81,7 +187,7 @@ void Edge::find_path_to(MLP *mlp, Layer *to, std::vector<Edge*> path){
 //-------------------------------------------
 
 MLP *MLP::make_path(Layer *from, Layer *to) {
-   MLP *path = new MLP;
+   MLP *path = new MLP(context);
    std::vector<Edge*> min_path;
    for (auto edge:edges)
       if (edge->to == from || edge->from == from) {
@@ -101,7 +207,7 @@ MLP *MLP::make_path(Layer *from, Layer *to) {
 }
 
 MLP *MLP::make_path_to_bottom(Layer *src){
-   MLP *path = new MLP;
+   MLP *path = new MLP(context);
    
    Is_Below is_below_src(src, this);
    for (auto edge:edges) {
@@ -131,6 +237,7 @@ MLP *MLP::make_path_from_bottom(Layer *dest) {
 
 RBM *MLP::make_rbm_level(int level) {
    RBM *rbm = new RBM;
+   rbm->context = context;
    for (auto edge:edges) edge->level = 0;
    auto edge = edges.begin();
    while ( !check_levels() ) {
@@ -153,7 +260,7 @@ RBM *MLP::make_rbm_level(int level) {
 }
 
 MLP *MLP::make_level_to_level(int bot, int top) {
-   MLP *slice_MLP = new MLP;
+   MLP *slice_MLP = new MLP(context);
    for (auto edge:edges) edge->level = 0;
    auto edge = edges.begin();
    while ( !check_levels() ) {
@@ -269,6 +376,38 @@ void MLP::make_batch(int batch_size){
 }
 
 void MLP::make_batch_for_whole_input(){
+   make_batch(shard_input_size());
+}
+
+int MLP::input_size(){
+   int rows = 0;
+   for_each_shard([&](){ rows += shard_input_size(); });
+   return rows;
+}
+
+// Runs visit with each shard of the training sets open in turn (just once for anything else, or sets that
+// aren't streamed from a catalog) and then reopens the shards that were open before.
+void MLP::for_each_shard(std::function<void()> visit){
+   int count = 1;
+   std::vector<int> open;
+   for (auto input:inputs) {
+      if (d_flag == TRAIN) count = std::max(count, input->dataset->shard_count());
+      open.push_back(input->dataset->shard);
+   }
+   
+   for (int s = 0; s < count; ++s) {
+      bool opened = true;
+      for (auto input:inputs) {
+         DataSet *dataset = input->dataset;
+         if (count > 1 && s < dataset->shard_count() && dataset->shard != s) opened = dataset->open_shard(s) && opened;
+      }
+      if (opened) visit();
+   }
+   for (int i = 0; i < inputs.size(); ++i)
+      if (count > 1 && inputs[i]->dataset->shard != open[i]) inputs[i]->dataset->open_shard(open[i]);
+}
+
+int MLP::shard_input_size(){
    int min_input_size = INFINITY;
    Input_t *data;
    for (auto input:inputs) {
@@ -277,7 +416,7 @@ void MLP::make_batch_for_whole_input(){
       else if (d_flag == TIMECOURSE)   data = input->dataset->extra;
       if (data->size1 < min_input_size) min_input_size = (int)data->size1;
    }
-   make_batch(min_input_size);
+   return min_input_size;
 }
 
 void MLP::set_status_all(Node_status_flag_t status) {
@@ -309,19 +448,100 @@ void MLP::transport_data(MLP *to_mlp) {
       Layer *dest = edge->from;
       MLP *input_tranport = make_path_from_bottom(dest);
       input_tranport->d_flag = TRAIN;
-      input_tranport->sample_flag = NOSAMPLE;
-      input_tranport->make_batch_for_whole_input();
-      input_tranport->init_data();
-      input_tranport->transmit(FORWARD);
-      DataSet *dataset = new DataSet;
-      dataset->train = gsl_matrix_float_alloc(dest->samples->size2, dest->samples->size1);
-      gsl_matrix_float_transpose_memcpy(dataset->train, dest->samples);
+      input_tranport->transport_chunk = transport_chunk;
+      input_tranport->cache_features = cache_features;
+      DataSet *dataset = new DataSet(context);
+      dataset->train = input_tranport->propagated_features(dest);
       Input_Edge *input_edge = new Input_Edge(dataset, dest);
       to_mlp->inputs.push_back(input_edge);
    }
    
 }
 
+// Pushes the whole input through to dest transport_chunk rows at a time, so the layers only ever hold
+// one chunk.  out has to be input_size() x dest->nodenum; row i is the (mean field) feature of sample i,
+// counting through the shards in order.
+void MLP::propagate(Layer *dest, Input_t *out){
+   sample_flag = NOSAMPLE;
+   
+   int start = 0, chunk = 0;
+   for_each_shard([&](){
+      init_data();
+      int rows = std::min(shard_input_size(), (int)out->size1 - start);
+      for (int done = 0; done < rows; done += chunk) {
+         int n = std::min(transport_chunk, rows - done);
+         if (n != chunk) make_batch(n);
+         chunk = n;
+         
+         transmit(FORWARD);
+         gsl_matrix_float_view rows_out = gsl_matrix_float_submatrix(out, start + done, 0, n, out->size2);
+         gsl_matrix_float_transpose_memcpy(&rows_out.matrix, dest->samples);
+      }
+      start += rows;
+   });
+}
+
+// The features only depend on the input and everything below dest, so if cache_features is on they get
+// saved under a hash of the input data, the layer types and the weights, and reused the next time the
+// level is built.  Hashing the input (every shard of it) costs a read of it, which is still far less than
+// propagating it, and means any change to the data or its preprocessing (normalizing, masking) misses the
+// cache.
+Input_t *MLP::propagated_features(Layer *dest){
+   int rows = input_size();
+   std::string cachefile;
+   
+   if (cache_features) {
+      uint64_t key = 14695981039346656037ULL;
+      for_each_shard([&](){
+         for (auto input:inputs) {
+            Input_t *data = (d_flag == TRAIN) ? input->dataset->train : (d_flag == TEST) ? input->dataset->test : input->dataset->extra;
+            Quantized_Matrix *packed = input->dataset->quantized_of(data);
+            if (packed != NULL) key = hash_bytes(packed->mapping()->data, packed->mapping()->size, key);
+            else if (data != NULL) key = hash_gsl(data, key);
+         }
+      });
+      for (auto input:inputs) {
+         Input_t *data = (d_flag == TRAIN) ? input->dataset->train : (d_flag == TEST) ? input->dataset->test : input->dataset->extra;
+         // An out of core set is preprocessed as it's read, so its file doesn't say what the features saw.
+         if (data != NULL && input->dataset->out_of_core(data))
+            for (auto p:input->dataset->preprocessing) {
+               key = hash_gsl(p->mean, key);
+               key = hash_gsl(p->sd, key);
+               key = hash_bytes(p->columns->data, p->columns->size*sizeof(int), key);
+            }
+      }
+      for (auto edge:edges) {
+         Connection *connection = (Connection*)edge;
+         const char *from_type = typeid(*connection->from).name(), *to_type = typeid(*connection->to).name();
+         key = hash_bytes(from_type, strlen(from_type), key);
+         key = hash_bytes(to_type, strlen(to_type), key);
+         key = hash_gsl(connection->weights, key);
+         key = hash_gsl(connection->from->biases, key);
+         key = hash_gsl(connection->to->biases, key);
+      }
+      std::stringstream n;
+      n << context->cachepath << "features";
+      for (auto input:inputs) n << "_" << input->dataset->name;
+      n << "_" << rows << "x" << dest->nodenum << "_" << std::hex << key << ".bin";
+      cachefile = n.str();
+      
+      Input_t *cached = load_gsl_matrix_binary(cachefile);
+      if (cached != NULL) {
+         std::cout << "Loaded cached features from " << cachefile << std::endl;
+         return cached;
+      }
+   }
+   
+   Input_t *features = gsl_matrix_float_alloc(rows, dest->nodenum);
+   propagate(dest, features);
+   
+   if (cache_features) {
+      mkdir(context->cachepath.c_str(), 0755);
+      save_gsl_matrix_binary(features, cachefile);
+   }
+   return features;
+}
+
 //------------------------------------------------------------------------------
 
 int MLP::transmit(Direction_flag_t direction) {
@@ -362,11 +582,30 @@ void MLP::init_data(){
    }
 }
 
+// Over the whole input, one shard at a time: each shard's cost is a mean over its rows, so they're
+// averaged weighted by rows.
 void MLP::getReconstructionCost(){
+   float total = 0;
+   int rows = 0;
+   for_each_shard([&](){
+      getShardReconstructionCost();
+      int n = shard_input_size();
+      total += reconstruction_cost*n;
+      rows += n;
+   });
+   reconstruction_cost = (rows > 0) ? total/rows : 0;
+}
+
+void MLP::getShardReconstructionCost(){
    
    sample_flag = NOSAMPLE;
    init_data();
-   make_batch_for_whole_input();
+   if (plan_memory) {
+      if (planner == NULL) planner = new Memory_Planner;
+      planner->plan(this, shard_input_size(), RECONSTRUCTION_PASS);
+      planner->apply();
+   }
+   else make_batch_for_whole_input();
    transmit(FORWARD);
    
    if (inputs.size() != 0) for (auto input:inputs) {
@@ -9,7 +9,9 @@
 #ifndef __DBN__MLP__
 #define __DBN__MLP__
 
+#include <functional>
 #include "Types.h"
+#include "Context.h"
 
 class DataSet;
 class Connection;
@@ -17,6 +19,8 @@ class Layer;
 class Data_Function;
 class MLP;
 class RBM;
+class Memory_Planner;
+class Batch_Prefetcher;
 
 class Edge {
 public:
@@ -38,11 +42,32 @@ public:
    
    gsl_matrix_float  *input_matrix;
    
+   Batch_Prefetcher  *prefetcher;         // NULL unless prefetching is on.
+   
+   // Shuffled sampling for training.  Each epoch walks a fresh permutation of the rows, gathered into a
+   // contiguous aligned buffer before the transpose.  The rows that don't fill a last batch are carried to
+   // the front of the next permutation, so nothing gets skipped over the run.  Ordered training wraps the
+   // last batch around to the first rows instead, and carry is how many the next epoch skips.
+   bool              shuffle;
+   gsl_vector_int    *order;
+   int               carry;
+   float             *gather_buffer;
+   int               gather_size;
+   
    Input_Edge(DataSet *data, Layer* to_layer);
-   ~Input_Edge(){}
+   ~Input_Edge();
    
    int transmit_signal(Sample_flag_t);
    int pull_data(Sample_flag_t);
+   int pull_batch(Input_t *input, Sample_flag_t);
+   void set_prefetch(bool on);
+   
+   bool training(Sample_flag_t s_flag) {return d_flag == TRAIN && s_flag == SAMPLE;}
+   bool shuffling(Sample_flag_t s_flag) {return shuffle && training(s_flag);}
+   bool epoch_over(Input_t *input, int index, Sample_flag_t s_flag);
+   void start_epoch(Input_t *input, Sample_flag_t s_flag);
+   void end_epoch(Input_t *input, Sample_flag_t s_flag);
+   void gather(Input_t *input, int index, gsl_matrix_float *dest, bool shuffled);
    void pull_model();
    struct Data_Is;
 };
@@ -66,7 +91,19 @@ public:
    
    float reconstruction_cost;
    
-   MLP(){}
+   int                                       transport_chunk;     // Rows per pass when propagating data up to a level
+   bool                                      cache_features;      // Keep propagated features on disk, keyed on the weights below
+   bool                                      plan_memory;         // Share scratch buffers in whole-input passes
+   Memory_Planner                            *planner;
+   Context                                   *context;
+   
+   MLP(Context *c = NULL){
+      context = (c == NULL) ? Context::default_context() : c;
+      transport_chunk = 256;
+      cache_features = false;
+      plan_memory = false;
+      planner = NULL;
+   }
    
    struct From_To_Check {
       From_To_Check(){}
@@ -132,12 +169,18 @@ public:
    int transmit(Direction_flag_t);
    
    void make_batch(int batch_size);
-   void make_batch_for_whole_input();
+   void make_batch_for_whole_input();                   // The open shard, when training from a catalog
+   int input_size();                                    // Rows across every shard
+   int shard_input_size();
+   void for_each_shard(std::function<void()> visit);
    
    void getReconstructionCost();
+   void getShardReconstructionCost();
    bool check_levels();
    
    void transport_data(MLP *to_mlp);
+   void propagate(Layer *dest, Input_t *out);
+   Input_t *propagated_features(Layer *dest);
    bool is_hanging(Edge *edge);
 };
 
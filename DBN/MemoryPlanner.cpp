@@ -0,0 +1,311 @@
+//
+//  MemoryPlanner.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include "MemoryPlanner.h"
+#include "Layers.h"
+
+Memory_Planner::Memory_Planner() : batchsize(0), naive_size(0) {}
+
+Memory_Planner::~Memory_Planner(){
+   release();
+}
+
+gsl_matrix_float **Memory_Planner::member(Layer *layer, Buffer_flag_t type){
+   switch (type) {
+      case ACTIVATIONS  : return &layer->activations;
+      case EXPECTATIONS : return &layer->expectations;
+      case SAMPLES      : return &layer->samples;
+      case BATCHBIASES  : return &layer->batchbiases;
+      case EXTRA        : return &layer->extra;
+      case STAT1        : return &layer->stat1;
+      case STAT2        : return &layer->stat2;
+      default           : return NULL;
+   }
+}
+
+Memory_Planner::Buffer *Memory_Planner::find(Layer *layer, Buffer_flag_t type){
+   for (auto &buffer:buffers) if (buffer.layer == layer && buffer.type == type) return &buffer;
+   return NULL;
+}
+
+int Memory_Planner::step(bool is_elementwise){
+   elementwise.push_back(is_elementwise);
+   return (int)elementwise.size() - 1;
+}
+
+void Memory_Planner::touch(Layer *layer, Buffer_flag_t type, int at){
+   Buffer *buffer = find(layer, type);
+   if (buffer == NULL) return;
+   if (buffer->first < 0) buffer->first = at;
+   buffer->last = at;
+}
+
+void Memory_Planner::add_layer(Layer *layer){
+   if (layer == NULL || std::find(layers.begin(), layers.end(), layer) != layers.end()) return;
+   layers.push_back(layer);
+   for (int t = 0; t < BUFFER_TYPES; ++t) {
+      Buffer buffer = {layer, (Buffer_flag_t)t, (size_t)layer->nodenum*batchsize, -1, -1, -1};
+      buffers.push_back(buffer);
+   }
+   naive_size += BUFFER_TYPES*(size_t)layer->nodenum*batchsize;
+   if (dynamic_cast<GaussianLayer*>(layer) != NULL) naive_size += 2*(size_t)layer->nodenum*batchsize; // stat3 and stat4
+}
+
+//------------------------------------------------------------------------------
+// These mirror Layer::finish_activation, MLP::transmit, Connection::gibbs_sweep and Connection::catch_stats
+// step for step.
+
+void Memory_Planner::simulate_finish(Layer *layer, Sample_flag_t s_flag){
+   if (status[layer] == SAMPLED) return;
+   
+   int s = step(true);                                      // expandBiases
+   touch(layer, BATCHBIASES, s);
+   s = step(true);                                          // activations += batchbiases
+   touch(layer, BATCHBIASES, s);
+   touch(layer, ACTIVATIONS, s);
+   s = step(dynamic_cast<SoftmaxLayer*>(layer) == NULL);    // getExpectations, softmax needs whole columns
+   touch(layer, ACTIVATIONS, s);
+   touch(layer, EXPECTATIONS, s);
+   s = step(true);                                          // sample (plus noise), or copy the expectations
+   touch(layer, EXPECTATIONS, s);
+   touch(layer, SAMPLES, s);
+   
+   status[layer] = SAMPLED;
+}
+
+void Memory_Planner::simulate_transmit(MLP *mlp, Direction_flag_t direction, Sample_flag_t s_flag){
+   for (auto edge:mlp->edges) status[edge->from] = status[edge->to] = SAMPLED;
+   
+   std::map<Edge*, Direction_flag_t> direction_of;
+   Layer *to2 = NULL;
+   for (auto edge:mlp->transmit_list) {
+      if (edge->to == to2) direction = (Direction_flag_t)(!direction);
+      direction_of[edge] = direction;
+      to2 = edge->to;
+   }
+   
+   MLP::edge_list_t &order = (direction == FORWARD) ? mlp->transmit_list : mlp->r_transmit_list;
+   for (auto edge:order) {
+      if (edge->from == NULL) {                             // Input edge, pulls (and maybe corrupts) data
+         if (direction_of[edge] == FORWARD) {
+            touch(edge->to, SAMPLES, step(true));
+            status[edge->to] = SAMPLED;
+         }
+         continue;
+      }
+      
+      Layer *input = edge->from, *output = edge->to;
+      if (direction_of[edge] == BACKWARD) std::swap(input, output);
+      
+      if (status[input] == ACTIVATED) simulate_finish(input, s_flag);
+      if (status[output] == FROZEN) continue;
+      
+      int s = step(false);                                  // GEMM into the activations
+      touch(input, SAMPLES, s);
+      touch(output, ACTIVATIONS, s);
+      status[output] = ACTIVATED;
+   }
+   
+   for (auto edge:mlp->transmit_list) {
+      if (status[edge->to] == ACTIVATED) simulate_finish(edge->to, s_flag);
+      if (edge->from != NULL && status[edge->from] == ACTIVATED) simulate_finish(edge->from, s_flag);
+   }
+}
+
+// Connection::gibbs_sweep: each half is a GEMM into the other layer's expectations, then the fused
+// activation turns them into samples in place.
+void Memory_Planner::simulate_sweep(Edge *edge){
+   Layer *visible = edge->from, *hidden = edge->to;
+   Layer *halves[2][2] = {{hidden, visible}, {visible, hidden}};
+   for (auto half:halves) {
+      Layer *input = half[0], *output = half[1];
+      int s = step(false);
+      touch(input, SAMPLES, s);
+      touch(output, EXPECTATIONS, s);
+      s = step(dynamic_cast<SoftmaxLayer*>(output) == NULL);
+      touch(output, EXPECTATIONS, s);
+      touch(output, SAMPLES, s);
+   }
+   status[visible] = status[hidden] = SAMPLED;
+}
+
+void Memory_Planner::simulate_catch(MLP *mlp, Stat_flag_t stat_flag){
+   Buffer_flag_t stat = (stat_flag == POS) ? STAT1 : STAT2;
+   for (auto edge:mlp->edges) {
+      int s = step(true);
+      touch(edge->from, SAMPLES, s);
+      touch(edge->from, stat, s);
+      s = step(true);
+      touch(edge->to, (stat_flag == POS) ? SAMPLES : EXPECTATIONS, s);
+      touch(edge->to, stat, s);
+   }
+}
+
+//------------------------------------------------------------------------------
+
+void Memory_Planner::plan(MLP *mlp, int bs, Schedule_flag_t schedule){
+   release();
+   layers.clear();
+   buffers.clear();
+   elementwise.clear();
+   status.clear();
+   batchsize = bs;
+   naive_size = 0;
+   
+   for (auto input:mlp->inputs) add_layer(input->to);
+   for (auto edge:mlp->edges) {
+      add_layer(edge->from);
+      add_layer(edge->to);
+   }
+   
+   switch (schedule) {
+      case FORWARD_PASS :
+         simulate_transmit(mlp, FORWARD, NOSAMPLE);
+         break;
+         
+      case RECONSTRUCTION_PASS : {
+         // Same as MLP::getShardReconstructionCost
+         std::vector<Layer*> visible;
+         for (auto input:mlp->inputs) visible.push_back(input->to);
+         if (visible.size() == 0) visible.push_back(mlp->transmit_list[0]->from);
+         
+         simulate_transmit(mlp, FORWARD, NOSAMPLE);
+         for (auto layer:visible) {
+            int s = step(true);
+            touch(layer, SAMPLES, s);
+            touch(layer, EXTRA, s);
+         }
+         simulate_transmit(mlp, BACKWARD, NOSAMPLE);
+         int s = step(false);
+         for (auto layer:visible) {
+            touch(layer, EXTRA, s);
+            touch(layer, SAMPLES, s);
+         }
+         break;
+      }
+         
+      case CD_PASS : {
+         // One batch of ContrastiveDivergence::teachRBM and getStats.  More Gibbs steps touch the same buffers
+         // again, so one is enough for the lifetimes.  A single connection runs the fused sweep on the
+         // samples and expectations, anything else goes through transmit.
+         mlp->make_input_to_top_transmit_list();
+         simulate_transmit(mlp, FORWARD, SAMPLE);
+         mlp->make_bottom_to_top_transmit_list();
+         simulate_catch(mlp, POS);
+         if (mlp->edges.size() == 1) simulate_sweep(mlp->edges[0]);
+         else {
+            simulate_transmit(mlp, BACKWARD, SAMPLE);
+            simulate_transmit(mlp, FORWARD, SAMPLE);
+         }
+         simulate_catch(mlp, NEG);
+         int s = step(false);
+         for (auto edge:mlp->edges) {
+            touch(edge->from, STAT1, s);
+            touch(edge->from, STAT2, s);
+            touch(edge->to, STAT1, s);
+            touch(edge->to, STAT2, s);
+         }
+         break;
+      }
+   }
+   
+   // Whatever ends up on top is left for the caller; the monitors read the top activations and samples.
+   if (mlp->transmit_list.size() != 0) {
+      int s = step(false);
+      Layer *top = mlp->transmit_list.back()->to;
+      touch(top, ACTIVATIONS, s);
+      touch(top, SAMPLES, s);
+   }
+   
+   assign_slots();
+}
+
+// Greedy interval packing in order of first use, taking the tightest free block that fits (or growing the
+// biggest free one) before making a new one.
+void Memory_Planner::assign_slots(){
+   std::vector<int> owner_first;
+   slots.clear();
+   
+   std::vector<Buffer*> order;
+   for (auto &buffer:buffers) if (buffer.first >= 0) order.push_back(&buffer);
+   std::stable_sort(order.begin(), order.end(), [](Buffer *b1, Buffer *b2) {return b1->first < b2->first;});
+   
+   for (auto buffer:order) {
+      int best = -1;
+      for (int i = 0; i < slots.size(); ++i) {
+         bool is_free = slots[i].free_at < buffer->first ||
+                        (slots[i].free_at == buffer->first && elementwise[buffer->first] && owner_first[i] < buffer->first);
+         if (!is_free) continue;
+         if (best < 0) best = i;
+         else if (slots[best].size < buffer->size) {
+            if (slots[i].size > slots[best].size) best = i;
+         }
+         else if (slots[i].size >= buffer->size && slots[i].size < slots[best].size) best = i;
+      }
+      if (best < 0) {
+         Slot slot = {0, -1, NULL};
+         slots.push_back(slot);
+         owner_first.push_back(-1);
+         best = (int)slots.size() - 1;
+      }
+      slots[best].size = std::max(slots[best].size, buffer->size);
+      slots[best].free_at = buffer->last;
+      owner_first[best] = buffer->first;
+      buffer->slot = best;
+   }
+}
+
+void Memory_Planner::apply(){
+   if (slots.size() == 0) return;
+   int largest = 0;
+   for (int i = 0; i < slots.size(); ++i) {
+      slots[i].block = gsl_block_float_alloc(slots[i].size);
+      if (slots[i].size > slots[largest].size) largest = i;
+   }
+   
+   for (auto &buffer:buffers) {
+      gsl_matrix_float **matrix = member(buffer.layer, buffer.type);
+      gsl_matrix_float_free(*matrix);
+      Slot &slot = slots[(buffer.slot < 0) ? largest : buffer.slot];
+      *matrix = gsl_matrix_float_alloc_from_block(slot.block, 0, buffer.layer->nodenum, batchsize, batchsize);
+   }
+   for (auto layer:layers) layer->batchsize = batchsize;
+}
+
+// Any layer still looking at the planned blocks drops back to its own matrices with a batch of one.
+void Memory_Planner::release(){
+   bool applied = false;
+   for (auto slot:slots) applied |= (slot.block != NULL);
+   if (!applied) return;
+   
+   for (auto layer:layers) {
+      bool planned = false;
+      for (int t = 0; t < BUFFER_TYPES; ++t)
+         for (auto slot:slots) planned |= ((*member(layer, (Buffer_flag_t)t))->block == slot.block);
+      if (planned) layer->make_batch(1);
+   }
+   for (auto &slot:slots) {
+      gsl_block_float_free(slot.block);
+      slot.block = NULL;
+   }
+}
+
+size_t Memory_Planner::planned_bytes(){
+   size_t size = 0;
+   for (auto slot:slots) size += slot.size;
+   return size*sizeof(float);
+}
+
+void Memory_Planner::report(){
+   int live = 0;
+   for (auto buffer:buffers) live += (buffer.first >= 0);
+   std::cout << "Memory plan for batch size " << batchsize << ", " << layers.size() << " layers" << std::endl;
+   std::cout << "     Buffers: " << buffers.size() << " (" << live << " used) in " << slots.size() << " blocks" << std::endl;
+   std::cout << "     Naive: " << naive_bytes()/1048576.0 << " MB" << std::endl;
+   std::cout << "     Planned: " << planned_bytes()/1048576.0 << " MB" << std::endl;
+}
@@ -0,0 +1,88 @@
+//
+//  MemoryPlanner.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__MemoryPlanner__
+#define __DBN__MemoryPlanner__
+
+#include <iostream>
+#include "Types.h"
+#include "MLP.h"
+
+class Layer;
+
+typedef enum{FORWARD_PASS, RECONSTRUCTION_PASS, CD_PASS} Schedule_flag_t;
+
+/////////////////////////////////////
+// Memory planner
+/////////////////////////////////////
+
+// Every layer owns seven nodenum x batchsize scratch matrices, which is a lot of copies of the data when the
+// batch is the whole input.  The planner walks the same steps MLP::transmit (and CD) would take over an MLP,
+// records when each of those matrices is first and last touched, and packs the ones whose lifetimes don't
+// overlap into shared blocks.  A buffer can also take over a block at the very step another one dies if that
+// step is elementwise (like activations -> expectations), since then in place is fine.
+//
+// apply() points the layers' matrices at views into the planned blocks.  Freeing a view doesn't free the
+// block, so Layer::make_batch still works afterwards and just gives the layer its own matrices back.
+// Buffers the schedule never touches share whatever block is biggest, so only use a plan for the schedule
+// it was made for.
+class Memory_Planner {
+public:
+   
+   typedef enum{ACTIVATIONS, EXPECTATIONS, SAMPLES, BATCHBIASES, EXTRA, STAT1, STAT2, BUFFER_TYPES} Buffer_flag_t;
+   
+   struct Buffer {
+      Layer                *layer;
+      Buffer_flag_t        type;
+      size_t               size;
+      int                  first, last;
+      int                  slot;
+   };
+   
+   struct Slot {
+      size_t               size;
+      int                  free_at;
+      gsl_block_float      *block;
+   };
+   
+   std::vector<Layer*>     layers;
+   std::vector<Buffer>     buffers;
+   std::vector<Slot>       slots;
+   std::vector<bool>       elementwise;      // Per step, whether the op there can run in place
+   
+   int                     batchsize;
+   size_t                  naive_size;
+   
+   Memory_Planner();
+   ~Memory_Planner();
+   
+   void plan(MLP *mlp, int batchsize, Schedule_flag_t schedule);
+   void apply();
+   void release();
+   
+   size_t naive_bytes()    {return naive_size*sizeof(float);}
+   size_t planned_bytes();
+   void report();
+   
+private:
+   std::map<Layer*, Node_status_flag_t> status;
+   
+   gsl_matrix_float **member(Layer *layer, Buffer_flag_t type);
+   Buffer *find(Layer *layer, Buffer_flag_t type);
+   int step(bool is_elementwise);
+   void touch(Layer *layer, Buffer_flag_t type, int at);
+   void add_layer(Layer *layer);
+   
+   void simulate_finish(Layer *layer, Sample_flag_t s_flag);
+   void simulate_transmit(MLP *mlp, Direction_flag_t direction, Sample_flag_t s_flag);
+   void simulate_sweep(Edge *edge);
+   void simulate_catch(MLP *mlp, Stat_flag_t stat_flag);
+   void assign_slots();
+};
+
+#endif /* defined(__DBN__MemoryPlanner__) */
@@ -0,0 +1,151 @@
+//
+//  ModelBank.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include "ModelBank.h"
+#include "RBM.h"
+#include "Connections.h"
+#include "Layers.h"
+#include "IO.h"
+#include "Monitors.h"
+#include "MLP.h"
+
+Model_Bank::Model_Bank(float momentum, int k, int batchsize, int epochs) : ContrastiveDivergence(momentum, k, batchsize, epochs) {
+   dataset = NULL;
+   stacked_weights = NULL;
+   stacked_activations = NULL;
+   batch = NULL;
+}
+
+// Models added after the weights were stacked get the stack rebuilt before the next teach.
+void Model_Bank::add(RBM *rbm){
+   if (rbm->edges.size() != 1 || rbm->inputs.size() != 1) {
+      std::cerr << "Model bank: each RBM needs exactly one connection and one input" << std::endl;
+      return;
+   }
+   if (std::find(rbms.begin(), rbms.end(), rbm) != rbms.end()) {
+      std::cerr << "Model bank: that RBM is already in the bank" << std::endl;
+      return;
+   }
+   if (rbms.size() == 0) dataset = rbm->inputs[0]->dataset;
+   else if (rbm->inputs[0]->dataset != dataset || rbm->edges[0]->from->nodenum != rbms[0]->edges[0]->from->nodenum) {
+      std::cerr << "Model bank: all RBMs have to share the same input" << std::endl;
+      return;
+   }
+   if (stacked_weights != NULL) unstack();
+   rbm->teacher = this;
+   rbms.push_back(rbm);
+}
+
+// Copies every connection's weights into the stack and hands the connection a view of its block back, so
+// the normal per-connection updates write straight into the stack.
+void Model_Bank::stack(){
+   int visible = rbms[0]->edges[0]->from->nodenum;
+   int hidden = 0;
+   for (auto rbm:rbms) hidden += rbm->edges[0]->to->nodenum;
+   
+   stacked_weights = context->alloc_matrix(hidden, visible);
+   stacked_activations = context->alloc_matrix(hidden, batchsize);
+   batch = context->alloc_matrix(visible, batchsize);
+   
+   int offset = 0;
+   for (auto rbm:rbms) {
+      Connection *connection = (Connection*)rbm->edges[0];
+      int nodenum = connection->to->nodenum;
+      gsl_matrix_float *block = gsl_matrix_float_alloc_from_block(stacked_weights->block, offset*visible, nodenum, visible, visible);
+      gsl_matrix_float_memcpy(block, connection->weights);
+      gsl_matrix_float_free(connection->weights);
+      connection->weights = block;
+      offset += nodenum;
+   }
+}
+
+// Gives every connection its own copy of its weights back and frees the stack.
+void Model_Bank::unstack(){
+   for (auto rbm:rbms) {
+      Connection *connection = (Connection*)rbm->edges[0];
+      gsl_matrix_float *weights = gsl_matrix_float_alloc(connection->weights->size1, connection->weights->size2);
+      gsl_matrix_float_memcpy(weights, connection->weights);
+      gsl_matrix_float_free(connection->weights);
+      connection->weights = weights;
+   }
+   gsl_matrix_float_free(stacked_weights);
+   gsl_matrix_float_free(stacked_activations);
+   gsl_matrix_float_free(batch);
+   stacked_weights = stacked_activations = batch = NULL;
+}
+
+// Reads the next batch once, with one draw of input noise shared by every model, and returns 0 at the end
+// of the epoch.  It's pulled through the first model's Input_Edge, so the bank gets the same batches one
+// model trained alone would: shuffled or not, prefetched, the last partial batch, every catalog shard.
+int Model_Bank::pull_batch(){
+   RBM *first = rbms[0];
+   if (!first->inputs[0]->pull_data(SAMPLE)) return 0;
+   gsl_matrix_float_memcpy(batch, first->edges[0]->from->samples);
+   return 1;
+}
+
+void Model_Bank::teach(){
+   if (rbms.size() == 0) return;
+   if (checkpointer != NULL) {
+      std::cerr << "Model bank: checkpoints hold one model, train the bank without a checkpointer" << std::endl;
+      return;
+   }
+   if (stacked_weights == NULL) stack();
+   
+   learning = true;
+   learning_multiplier = 1;
+   
+   for (int epoch = 0; epoch < epochs && learning; ++epoch) {
+      std::cout << std::endl << "Teaching bank of " << rbms.size() << " RBMs, epoch " << epoch << std::endl << "     K: " << k << std::endl << "     Batch Size: " << batchsize << std::endl;
+      
+      for (auto rbm:rbms) {
+         rbm->make_batch(batchsize);
+         rbm->sample_flag = SAMPLE;
+         rbm->d_flag = TRAIN;
+      }
+      rbms[0]->init_data();
+      
+      while (pull_batch()) {
+         gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, stacked_weights, batch, 0, stacked_activations);
+         
+         int offset = 0;
+         for (auto rbm:rbms) {
+            Layer *visible = rbm->edges[0]->from;
+            Layer *hidden = rbm->edges[0]->to;
+            
+            gsl_matrix_float_memcpy(visible->samples, batch);
+            visible->status = SAMPLED;
+            
+            gsl_matrix_float_view block = gsl_matrix_float_submatrix(stacked_activations, offset, 0, hidden->nodenum, batchsize);
+            gsl_matrix_float_memcpy(hidden->activations, &block.matrix);
+            hidden->status = ACTIVATED;
+            hidden->finish_activation(SAMPLE);
+            offset += hidden->nodenum;
+            
+            getStats(rbm);
+            rbm->update(this);
+         }
+      }
+      
+      for (int m = 0; m < rbms.size(); ++m) {
+         Connection *connection = (Connection*)rbms[m]->edges[0];
+         rbms[m]->getReconstructionCost();
+         std::cout << "Model " << m << " (hidden " << connection->to->nodenum << ", rate " << connection->learning_rate << ", decay " << connection->decay << ") reconstruction cost: " << rbms[m]->reconstruction_cost << std::endl;
+      }
+      if (monitor != NULL) monitor->update();
+   }
+}
+
+// rbm->learn() lands here, so this trains the whole bank, but only once rbm has been added to it.
+void Model_Bank::teachRBM(RBM *rbm){
+   if (std::find(rbms.begin(), rbms.end(), rbm) == rbms.end()) {
+      std::cerr << "Model bank: add the RBM to the bank before teaching it" << std::endl;
+      return;
+   }
+   teach();
+}
@@ -0,0 +1,46 @@
+//
+//  ModelBank.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__ModelBank__
+#define __DBN__ModelBank__
+
+#include <iostream>
+#include "Teacher.h"
+
+class RBM;
+class DataSet;
+
+/////////////////////////////////////
+// Model bank
+/////////////////////////////////////
+
+// Trains a set of RBMs in lockstep on the same minibatches, for sweeps over learning rate, decay or hidden
+// size.  Each RBM is a single connection fed by its own Input_Edge, but all of them have to read the same
+// DataSet.  The connection weights are moved into one stacked (sum of hidden) x visible matrix, so the
+// positive phase for every model is a single GEMM over a batch that's only read (and corrupted) once.
+// The rest of CD and the updates run per model, using each connection's learning rate and decay.
+class Model_Bank : public ContrastiveDivergence {
+public:
+   std::vector<RBM*>       rbms;
+   DataSet                 *dataset;
+   
+   gsl_matrix_float        *stacked_weights;
+   gsl_matrix_float        *stacked_activations;
+   gsl_matrix_float        *batch;
+   
+   Model_Bank(float momentum, int k, int batchsize, int epochs);
+   
+   void add(RBM *rbm);
+   void stack();
+   void unstack();
+   int pull_batch();
+   void teach();
+   void teachRBM(RBM *rbm);
+};
+
+#endif /* defined(__DBN__ModelBank__) */
@@ -11,13 +11,16 @@
 #include "Layers.h"
 #include "Monitors.h"
 #include "IO.h"
+#include "RBM.h"
 
 Simple_3D_Monitor::Simple_3D_Monitor(DataSet *data) {
    threshold = 0;
    set_size(8, 5, 0);
    set_coords(0, 0, 0);
    
-   gsl_vector_float_view row = gsl_matrix_float_subrow(data->train, 0, 0, data->train->size2);
+   std::vector<float> first(data->train->size2);
+   data->read_rows(data->train, 0, 1, NULL, first.data());
+   gsl_vector_float_view row = gsl_vector_float_view_array(first.data(), data->columns_of(data->train));
    gsl_vector_float *vec = gsl_vector_float_calloc(data->dims[0]*data->dims[1]*data->dims[2]);
    
    data->apply_mask(vec, &row.vector);
@@ -286,8 +289,7 @@ void Feature_to_Data_Monitor::update() {
    
    mlp->transmit(BACKWARD);
    gsl_matrix_float_get_col(to->sample_vector, to->samples, 0);
-   output->dataset->transform_for_viz(output->input_matrix, to->sample_vector);
-   gsl_matrix_float_memcpy(viz_matrix,output->input_matrix);
+   output->dataset->transform_for_viz(viz_matrix, to->sample_vector);
 }
 
 Timecourse_Monitor::Timecourse_Monitor (int feat, MLP *source_mlp) : feature(feat) {
@@ -324,6 +326,41 @@ void Reconstruction_Cost_Monitor::update() {
    ++epoch;
 }
 
+Free_Energy_Monitor::Free_Energy_Monitor(RBM *monitored_rbm, int epochs, int r){
+   on = true;
+   set_coords(0, 0, 0);
+   set_size(8, 2, 0);
+   rbm = monitored_rbm;
+   dataset = rbm->inputs[0]->dataset;
+   rows = r;
+   border = new Border(this);
+   line_set = gsl_vector_float_calloc(epochs);
+   epoch = 0;
+}
+
+void Free_Energy_Monitor::update() {
+   if (dataset->validation == NULL) {
+      std::cerr << "Free energy monitor: " << dataset->name << " has no validation set, call splitValidate" << std::endl;
+      return;
+   }
+   // Mapped or quantized sets are read (and preprocessed) into memory first, just the rows that get used.
+   // The train rows are drawn from every shard when it's streamed from a catalog.
+   Input_t *sets[] = {dataset->train, dataset->validation};
+   float energies[2];
+   for (int s = 0; s < 2; ++s) {
+      Input_t *data;
+      if (s == 0 && dataset->shard_count() > 1) data = dataset->sample_train(rows);
+      else data = dataset->direct(sets[s]) ? sets[s] : dataset->sample_rows(sets[s], rows);
+      energies[s] = rbm->free_energy_of(data, rows);
+      if (data != sets[s]) gsl_matrix_float_free(data);
+   }
+   train_energy = energies[0];
+   validation_energy = energies[1];
+   std::cout << "Free energy: train " << train_energy << ", validation " << validation_energy << ", gap " << validation_energy - train_energy << std::endl;
+   if (epoch < line_set->size) gsl_vector_float_set(line_set, epoch, validation_energy - train_energy);
+   ++epoch;
+}
+
 /*
  void Unit_Monitor::plot(){
  std::string filepath = plotpath + name + "viz.plot";
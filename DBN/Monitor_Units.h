@@ -20,6 +20,7 @@ using std::vector;
 class DataSet;
 class MNIST_Feature_Monitor;
 class MLP;
+class RBM;
 class Layer;
 class Feature_to_Data_Monitor;
 class fMRI_Feature_Monitor;
@@ -126,4 +127,18 @@ public:
    void update();
 };
 
+// Overfitting check: mean free energy of a training subset against the held-out set (see
+// DataSet::splitValidate), plotted as the gap per epoch.  A growing gap means the model is fitting the
+// training samples themselves.  Only needs one pass over rows samples of each, no reconstruction.
+class Free_Energy_Monitor : public Plot_Unit {
+public:
+   RBM                     *rbm;
+   DataSet                 *dataset;
+   int                     rows;
+   int                     epoch;
+   float                   train_energy, validation_energy;
+   Free_Energy_Monitor(RBM *rbm, int epochs, int rows = 1000);
+   void update();
+};
+
 #endif /* defined(__DBN__File__) */
@@ -11,19 +11,23 @@
 #include "Monitor_Units.h"
 #include "Teacher.h"
 #include "DBN.h"
+#include "IO.h"
 
 
-New_Monitor::New_Monitor(){
-   viz = new Visualizer(1000,1000);
-   the_viz = viz;
+New_Monitor::New_Monitor(Context *c){
+   context = (c == NULL) ? Context::default_context() : c;
+   viz = new Visualizer(1000, 1000, context);
+   context->viz = viz;
    viz->init(1, 0);
 }
 
 
-Monitor::Monitor(){
-   viz = new Visualizer(1000,1000);
-   the_viz = viz;
-   the_monitor = this;
+Monitor::Monitor(Context *c){
+   context = (c == NULL) ? Context::default_context() : c;
+   viz = new Visualizer(1000, 1000, context);
+   context->viz = viz;
+   context->monitor = this;
+   Context::gui = context;
    monitor_top = false;
    top_number = 10;
 }
@@ -78,7 +82,7 @@ void Monitor::move_up_stack() {
    for (auto unit:stacked_units) unit->step_forward();
 }
 
-Single_3D_Data_Monitor::Single_3D_Data_Monitor(DataSet *data) {
+Single_3D_Data_Monitor::Single_3D_Data_Monitor(DataSet *data) : Monitor(data->context) {
    threshold = 0;
    Simple_3D_Monitor *stack = new Simple_3D_Monitor(data);
    main_units.push_back(stack);
@@ -86,12 +90,12 @@ Single_3D_Data_Monitor::Single_3D_Data_Monitor(DataSet *data) {
    viz->init((int)tex_units.size(), (int)plots.size()+(int)borders.size());
 }
 
-Layer_3D_fMRI_Monitor::Layer_3D_fMRI_Monitor(DBN *dbn) {
+Layer_3D_fMRI_Monitor::Layer_3D_fMRI_Monitor(DBN *dbn) : Monitor(dbn->context) {
    threshold = 0;
    
 }
 
-fMRI_Monitor::fMRI_Monitor(DBN *dbn){
+fMRI_Monitor::fMRI_Monitor(DBN *dbn) : Monitor(dbn->context) {
    fMRI_layer_monitor = new fMRI_Layer_Monitor(dbn->rc_MLP, 2000);
    for (auto feature:fMRI_layer_monitor->feature_images) feature->fMRI_image->threshold = 0.2;
    
@@ -100,7 +104,7 @@ fMRI_Monitor::fMRI_Monitor(DBN *dbn){
    viz->init((int)tex_units.size(), (int)plots.size()+(int)borders.size());
 }
 
-MNIST_Monitor::MNIST_Monitor(DBN *dbn) {
+MNIST_Monitor::MNIST_Monitor(DBN *dbn) : Monitor(dbn->context) {
    MNIST_monitor = new MNIST_Layer_Monitor(dbn->rc_MLP, 10);
    MNIST_monitor->set_coords(0, 3, 0);
    
@@ -28,6 +28,7 @@ class Simple_3D_Monitor;
 class DataSet;
 class Stacked_Tex_Unit;
 class Grid_Viz_Unit;
+class Context;
 
 using std::vector;
 
@@ -35,6 +36,7 @@ class Monitor {
 public:
    Teacher                          *teacher;
    Visualizer                       *viz;
+   Context                          *context;
    std::vector<Stacked_Tex_Unit*>   stacked_units;
    std::map <int, Tex_Unit*>        tex_units;
    std::map <int, Plot_Unit*>       plots;
@@ -47,7 +49,7 @@ public:
    bool                             monitor_top;
    int                              top_number;
    
-   Monitor();
+   Monitor(Context *context = NULL);
    void update();
    void update_stats();
    void reset_from_mains();
@@ -60,11 +62,12 @@ public:
 class New_Monitor {
 public:
    Visualizer                       *viz;
+   Context                          *context;
    vector<Tex_Unit *>               tex_units;
    
    float                            threshold;
    
-   New_Monitor();
+   New_Monitor(Context *context = NULL);
    void update();
 };
 
@@ -0,0 +1,236 @@
+//
+//  Partition.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include <chrono>
+#include "Partition.h"
+#include "RBM.h"
+#include "Connections.h"
+#include "Layers.h"
+#include "Threads.h"
+
+AIS_Estimator::AIS_Estimator(RBM *rbm, int chains, int steps, Thread_Pool *threads) : rbm(rbm), chains(chains), threads(threads) {
+   block = 64;
+   log_Z = log_Z_low = log_Z_high = log_Z_base = 0;
+   if (this->threads == NULL) this->threads = rbm->context->pool();
+   make_schedule(steps);
+}
+
+// The usual schedule: 1/29 of the steps up to .5, 8/29 up to .9 and the rest up to 1.
+void AIS_Estimator::make_schedule(int steps){
+   float edges[] = {0, .5, .9, 1};
+   int counts[] = {steps/29, 8*steps/29, 0};
+   counts[2] = steps - counts[0] - counts[1];
+   
+   betas.clear();
+   betas.push_back(0);
+   for (int s = 0; s < 3; ++s)
+      for (int i = 1; i <= counts[s]; ++i) betas.push_back(edges[s] + (edges[s+1] - edges[s])*(float)i/(float)counts[s]);
+}
+
+// Adds the hidden free energy at beta to energy: the layer's own term on beta(x + c), passed in as
+// beta x + (beta - 1)c since freeEnergy_contibution adds the bias itself.
+void AIS_Estimator::hidden_term(Layer *hidden, gsl_matrix_float *x, gsl_matrix_float *scratch, float beta, gsl_vector_float *energy){
+   for (int i = 0; i < x->size1; ++i) {
+      float shift = (beta - 1)*gsl_vector_float_get(hidden->biases, i);
+      const float *in = x->data + i*x->tda;
+      float *out = scratch->data + i*scratch->tda;
+      for (int j = 0; j < x->size2; ++j) out[j] = beta*in[j] + shift;
+   }
+   hidden->freeEnergy_contibution(scratch, energy);
+}
+
+void AIS_Estimator::run_block(int b){
+   Connection *connection = (Connection*)rbm->edges[0];
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   int first = b*block;
+   int n = std::min(block, chains - first);
+   
+   gsl_rng *rng = gsl_rng_alloc(gsl_rng_rand48);
+   gsl_rng_set(rng, seed + b);
+   
+   gsl_matrix_float *v = gsl_matrix_float_alloc(visible->nodenum, n);
+   gsl_matrix_float *v_in = gsl_matrix_float_calloc(visible->nodenum, n);
+   gsl_matrix_float *x = gsl_matrix_float_alloc(hidden->nodenum, n);
+   gsl_matrix_float *scratch = gsl_matrix_float_alloc(hidden->nodenum, n);
+   gsl_matrix_float *h = gsl_matrix_float_alloc(hidden->nodenum, n);
+   gsl_vector_float *before = gsl_vector_float_alloc(n);
+   gsl_vector_float *after = gsl_vector_float_alloc(n);
+   std::vector<double> log_w(n, 0);
+   
+   // Exact samples from the base model.
+   visible->fused_activation(v_in, v_in, v, rng);
+   
+   for (int k = 1; k < betas.size(); ++k) {
+      gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, connection->weights, v, 0, x);
+      gsl_vector_float_set_zero(before);
+      gsl_vector_float_set_zero(after);
+      hidden_term(hidden, x, scratch, betas[k-1], before);
+      hidden_term(hidden, x, scratch, betas[k], after);
+      for (int j = 0; j < n; ++j) log_w[j] += gsl_vector_float_get(before, j) - gsl_vector_float_get(after, j);
+      
+      if (k + 1 == betas.size()) break;
+      
+      // Gibbs transition that leaves p_beta(v) invariant.
+      hidden->fused_activation(x, scratch, h, rng, betas[k]);
+      gsl_blas_sgemm(CblasTrans, CblasNoTrans, betas[k], connection->weights, h, 0, v_in);
+      visible->fused_activation(v_in, v_in, v, rng);
+   }
+   
+   for (int j = 0; j < n; ++j) log_weights[first + j] = log_w[j];
+   
+   gsl_matrix_float_free(v);
+   gsl_matrix_float_free(v_in);
+   gsl_matrix_float_free(x);
+   gsl_matrix_float_free(scratch);
+   gsl_matrix_float_free(h);
+   gsl_vector_float_free(before);
+   gsl_vector_float_free(after);
+   gsl_rng_free(rng);
+}
+
+double AIS_Estimator::estimate(){
+   if (rbm->edges.size() != 1) {
+      std::cerr << "AIS only works for single connection RBMs" << std::endl;
+      return 0;
+   }
+   Connection *connection = (Connection*)rbm->edges[0];
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   // Base model: the visible layer on its own, times the hidden free energy at beta = 0 (a constant).
+   gsl_matrix_float *zero = gsl_matrix_float_calloc(hidden->nodenum, 1);
+   gsl_matrix_float *scratch = gsl_matrix_float_alloc(hidden->nodenum, 1);
+   gsl_vector_float *constant = gsl_vector_float_calloc(1);
+   hidden_term(hidden, zero, scratch, 0, constant);
+   log_Z_base = visible->log_partition() - gsl_vector_float_get(constant, 0);
+   gsl_matrix_float_free(zero);
+   gsl_matrix_float_free(scratch);
+   gsl_vector_float_free(constant);
+   
+   bool v_noisy = visible->noisy, h_noisy = hidden->noisy;
+   visible->noisy = hidden->noisy = false;
+   
+   log_weights.assign(chains, 0);
+   seed = gsl_rng_get(rbm->context->rng);
+   int blocks = (chains + block - 1)/block;
+   threads->run(blocks, [&](int b, int worker){ run_block(b); });
+   
+   visible->noisy = v_noisy;
+   hidden->noisy = h_noisy;
+   
+   // log mean exp of the weights, and the same for mean +/- 3 standard errors.
+   double top = *std::max_element(log_weights.begin(), log_weights.end());
+   double mean = 0, var = 0;
+   for (auto w:log_weights) mean += exp(w - top);
+   mean /= chains;
+   for (auto w:log_weights) var += (exp(w - top) - mean)*(exp(w - top) - mean);
+   double se = sqrt(var/(chains - 1))/sqrt((double)chains);
+   
+   log_Z = log_Z_base + top + log(mean);
+   log_Z_high = log_Z_base + top + log(mean + 3*se);
+   log_Z_low = (mean > 3*se) ? log_Z_base + top + log(mean - 3*se) : -INFINITY;
+   
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   std::cout << "AIS log Z: " << log_Z << " (" << log_Z_low << ", " << log_Z_high << "), " << chains << " chains, " << betas.size() - 1 << " steps, " << seconds << "s" << std::endl;
+   return log_Z;
+}
+
+// Mean log p(v) over the data, with the last estimate of log Z.
+double AIS_Estimator::log_likelihood(Input_t *data, int rows){
+   return -rbm->free_energy_of(data, rows) - log_Z;
+}
+
+//------------------------------------------------------------------------------
+
+Exact_Partition::Exact_Partition(RBM *rbm, Thread_Pool *threads) : rbm(rbm), threads(threads) {
+   log_Z = 0;
+   prefix_bits = 8;
+   if (this->threads == NULL) this->threads = rbm->context->pool();
+}
+
+// Running log-sum-exp kept as (top, sum of exp(term - top)).
+static inline void accumulate(double term, double &top, double &sum){
+   if (term > top) {
+      sum = sum*exp(top - term) + 1;
+      top = term;
+   }
+   else sum += exp(term - top);
+}
+
+void Exact_Partition::run_prefix(int prefix){
+   Connection *connection = (Connection*)rbm->edges[0];
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   gsl_matrix_float *weights = connection->weights;
+   int bits = std::min(prefix_bits, hidden->nodenum);
+   int free_bits = hidden->nodenum - bits;
+   
+   // Start from the prefix with all free units off.
+   std::vector<char> h(hidden->nodenum, 0);
+   std::vector<double> field(visible->nodenum, 0);
+   double hidden_term = 0;
+   for (int b = 0; b < bits; ++b) {
+      if (!((prefix >> b) & 1)) continue;
+      int unit = free_bits + b;
+      h[unit] = 1;
+      hidden_term += gsl_vector_float_get(hidden->biases, unit);
+      const float *row = weights->data + unit*weights->tda;
+      for (int i = 0; i < visible->nodenum; ++i) field[i] += row[i];
+   }
+   
+   double top = -INFINITY, sum = 0;
+   accumulate(hidden_term + visible->log_partition(field.data()), top, sum);
+   
+   unsigned long states = 1UL << free_bits;
+   for (unsigned long g = 1; g < states; ++g) {
+      int unit = __builtin_ctzl(g);
+      float sign = h[unit] ? -1 : 1;
+      h[unit] = !h[unit];
+      hidden_term += sign*gsl_vector_float_get(hidden->biases, unit);
+      const float *row = weights->data + unit*weights->tda;
+      for (int i = 0; i < visible->nodenum; ++i) field[i] += sign*row[i];
+      accumulate(hidden_term + visible->log_partition(field.data()), top, sum);
+   }
+   
+   task_top[prefix] = top;
+   task_sum[prefix] = sum;
+}
+
+double Exact_Partition::compute(){
+   if (rbm->edges.size() != 1 || dynamic_cast<SigmoidLayer*>(rbm->edges[0]->to) == NULL) {
+      std::cerr << "Exact log Z needs a single connection RBM with binary hidden units" << std::endl;
+      return 0;
+   }
+   Layer *hidden = rbm->edges[0]->to;
+   if (hidden->nodenum > 30) {
+      std::cerr << "Too many hidden units (" << hidden->nodenum << ") to enumerate" << std::endl;
+      return 0;
+   }
+   
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   int tasks = 1 << std::min(prefix_bits, hidden->nodenum);
+   task_top.assign(tasks, 0);
+   task_sum.assign(tasks, 0);
+   threads->run(tasks, [&](int prefix, int worker){ run_prefix(prefix); });
+   
+   double top = -INFINITY, sum = 0;
+   for (int t = 0; t < tasks; ++t) top = std::max(top, task_top[t]);
+   for (int t = 0; t < tasks; ++t) sum += task_sum[t]*exp(task_top[t] - top);
+   log_Z = top + log(sum);
+   
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   std::cout << "Exact log Z: " << log_Z << ", " << (1UL << hidden->nodenum) << " hidden states, " << seconds << "s" << std::endl;
+   return log_Z;
+}
+
+double Exact_Partition::log_likelihood(Input_t *data, int rows){
+   return -rbm->free_energy_of(data, rows) - log_Z;
+}
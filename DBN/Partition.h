@@ -0,0 +1,82 @@
+//
+//  Partition.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Partition__
+#define __DBN__Partition__
+
+#include <iostream>
+#include "Types.h"
+
+class RBM;
+class Layer;
+class Connection;
+class Thread_Pool;
+
+/////////////////////////////////////
+// Annealed importance sampling
+/////////////////////////////////////
+
+// Estimates log Z of a single connection RBM by annealing from the model with no weights (visible biases
+// kept, hidden inputs scaled to zero) up to the RBM.  The intermediate models only scale the hidden side,
+// p_beta(v) ~ exp(-E_v(v)) prod_j sum_h exp(beta h.(Wv + c)), so the importance weights only need the hidden
+// free energy terms and the visible terms cancel.  The chains are columns of one matrix, split into blocks
+// that run in parallel, each with its own rng seeded from its block number.  Every step is one GEMM for the
+// weights and transition up, and one back down.  Input noise is switched off while running.
+class AIS_Estimator {
+public:
+   RBM                              *rbm;
+   int                              chains;
+   int                              block;
+   std::vector<float>               betas;
+   
+   Thread_Pool                      *threads;
+   
+   double                           log_Z_base;
+   double                           log_Z, log_Z_low, log_Z_high;   // Estimate and 3 standard error bounds.
+   
+   AIS_Estimator(RBM *rbm, int chains = 1000, int steps = 14500, Thread_Pool *threads = NULL);
+   
+   void make_schedule(int steps);
+   double estimate();
+   double log_likelihood(Input_t *data, int rows = 0);
+   
+private:
+   std::vector<double>              log_weights;
+   unsigned long                    seed;
+   
+   void hidden_term(Layer *hidden, gsl_matrix_float *x, gsl_matrix_float *scratch, float beta, gsl_vector_float *energy);
+   void run_block(int b);
+};
+
+/////////////////////////////////////
+// Exact partition function
+/////////////////////////////////////
+
+// Exact log Z for a single connection RBM with binary (sigmoid) hiddens, by summing over every hidden state
+// with the visibles integrated out: log Z = logsumexp_h [c.h + log Z_v(W'h)].  The top prefix_bits hidden
+// units are fixed per task and the rest are walked in Gray code order, so each step flips one unit and the
+// visible field changes by one row of the weights instead of a full GEMV.  Feasible up to ~25 hiddens.
+class Exact_Partition {
+public:
+   RBM                              *rbm;
+   Thread_Pool                      *threads;
+   int                              prefix_bits;
+   double                           log_Z;
+   
+   Exact_Partition(RBM *rbm, Thread_Pool *threads = NULL);
+   
+   double compute();
+   double log_likelihood(Input_t *data, int rows = 0);
+   
+private:
+   std::vector<double>              task_top, task_sum;
+   
+   void run_prefix(int prefix);
+};
+
+#endif /* defined(__DBN__Partition__) */
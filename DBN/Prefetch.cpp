@@ -0,0 +1,111 @@
+//
+//  Prefetch.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include <string.h>
+#include "Prefetch.h"
+#include "MLP.h"
+#include "Layers.h"
+#include "IO.h"
+
+Batch_Prefetcher::Batch_Prefetcher(Input_Edge *edge) : edge(edge), back(NULL), input(NULL), index(0), s_flag(NOSAMPLE), requested(false), ready(false), end(false), stopping(false) {
+   rng = edge->to->context->new_stream();
+   request_state = gsl_rng_clone(rng);
+   worker = std::thread(&Batch_Prefetcher::work, this);
+}
+
+Batch_Prefetcher::~Batch_Prefetcher(){
+   {
+      std::unique_lock<std::mutex> guard(lock);
+      stopping = true;
+   }
+   wake.notify_one();
+   worker.join();
+   if (back != NULL) gsl_matrix_float_free(back);
+   gsl_rng_free(rng);
+   gsl_rng_free(request_state);
+}
+
+bool Batch_Prefetcher::set_rng(const std::vector<char> &state){
+   std::unique_lock<std::mutex> guard(lock);
+   if (requested || state.size() != gsl_rng_size(rng)) return false;
+   memcpy(gsl_rng_state(rng), state.data(), state.size());
+   gsl_rng_memcpy(request_state, rng);
+   return true;
+}
+
+// Called with the worker idle.
+void Batch_Prefetcher::request(Input_t *in, int i, Sample_flag_t s){
+   Layer *to = edge->to;
+   if (back == NULL || back->size1 != to->nodenum || back->size2 != to->batchsize) {
+      if (back != NULL) gsl_matrix_float_free(back);
+      back = to->context->alloc_matrix(to->nodenum, to->batchsize);
+   }
+   gsl_rng_memcpy(request_state, rng);
+   input = in;
+   index = i;
+   s_flag = s;
+   ready = false;
+   requested = true;
+   wake.notify_one();
+}
+
+// The same as pull_data, into the back buffer.  The edge's gather buffer is only used from here while the
+// prefetcher is on.
+void Batch_Prefetcher::fill(){
+   Layer *to = edge->to;
+   end = edge->epoch_over(input, index, s_flag);
+   if (end) return;
+   
+   edge->gather(input, index, back, edge->shuffling(s_flag));
+   
+   if (to->noisy && s_flag == SAMPLE)
+      for (int i = 0; i < back->size1; ++i) {
+         float *row = back->data + i*back->tda;
+         for (int j = 0; j < back->size2; ++j) row[j] *= (gsl_rng_uniform(rng) >= to->noise);
+      }
+}
+
+void Batch_Prefetcher::work(){
+   std::unique_lock<std::mutex> guard(lock);
+   while (1) {
+      wake.wait(guard, [this]{return stopping || (requested && !ready);});
+      if (stopping) return;
+      guard.unlock();
+      fill();
+      guard.lock();
+      ready = true;
+      filled.notify_one();
+   }
+}
+
+int Batch_Prefetcher::next(Input_t *in, Sample_flag_t s){
+   Layer *to = edge->to;
+   DataSet *dataset = edge->dataset;
+   std::unique_lock<std::mutex> guard(lock);
+   
+   if (requested) filled.wait(guard, [this]{return ready;});
+   edge->start_epoch(in, s);
+   if (!requested || input != in || index != dataset->index || s_flag != s || back->size1 != to->nodenum || back->size2 != to->batchsize) {
+      request(in, dataset->index, s);
+      filled.wait(guard, [this]{return ready;});
+   }
+   requested = false;
+   
+   if (end) {
+      edge->end_epoch(in, s);
+      return 0;
+   }
+   
+   if (to->samples->owner) std::swap(to->samples, back);
+   else gsl_matrix_float_memcpy(to->samples, back);
+   
+   dataset->index += to->batchsize;
+   to->status = SAMPLED;
+   request(in, dataset->index, s);
+   return 1;
+}
@@ -0,0 +1,61 @@
+//
+//  Prefetch.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Prefetch__
+#define __DBN__Prefetch__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Types.h"
+
+class Input_Edge;
+
+/////////////////////////////////////
+// Batch prefetcher
+/////////////////////////////////////
+
+// Double buffering for Input_Edge::pull_data.  While batch N trains, a background thread slices, transposes
+// and corrupts batch N+1 into a back buffer, with its own rng.  next() waits for that buffer and swaps it
+// with the layer's samples by pointer, then asks for the batch after.  If the request doesn't match what was
+// prefetched (a different input, index or sample flag, or a new batch size) the batch is just rebuilt.
+// Layer samples that are views into a planned block aren't swapped, they get a copy instead.
+class Batch_Prefetcher {
+public:
+   Batch_Prefetcher(Input_Edge *edge);
+   ~Batch_Prefetcher();
+   
+   int next(Input_t *input, Sample_flag_t s_flag);
+   
+   // The rng as it was when the pending batch was requested, which is where a resumed run picks up, and
+   // setting it on a prefetcher that hasn't been asked for anything yet.
+   const gsl_rng *resume_rng() {return request_state;}
+   bool set_rng(const std::vector<char> &state);
+   
+private:
+   Input_Edge                 *edge;
+   gsl_matrix_float           *back;
+   gsl_rng                    *rng, *request_state;
+   
+   // The batch in (or waiting for) the back buffer.
+   Input_t                    *input;
+   int                        index;
+   Sample_flag_t              s_flag;
+   bool                       requested, ready, end;
+   
+   std::thread                worker;
+   std::mutex                 lock;
+   std::condition_variable    wake, filled;
+   bool                       stopping;
+   
+   void request(Input_t *input, int index, Sample_flag_t s_flag);
+   void fill();
+   void work();
+};
+
+#endif /* defined(__DBN__Prefetch__) */
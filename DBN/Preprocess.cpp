@@ -0,0 +1,202 @@
+//
+//  Preprocess.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include <math.h>
+#include <stdio.h>
+#include "Preprocess.h"
+
+static const uint32_t preprocess_magic = 0x44424e50; // "DBNP"
+static const uint32_t preprocess_version = 1;
+
+Preprocessor::Preprocessor(bool center, float sigma, bool masking)
+   : center(center), sigma(sigma), masking(masking), samples(0), mean(NULL), sd(NULL), columns(NULL) {}
+
+Preprocessor::~Preprocessor(){
+   if (mean != NULL) gsl_vector_float_free(mean);
+   if (sd != NULL) gsl_vector_float_free(sd);
+   if (columns != NULL) gsl_vector_int_free(columns);
+}
+
+void Preprocessor::fit(Input_t *input){
+   begin_fit((int)input->size2);
+   for (int i = 0; i < input->size1; ++i) fit_row(input->data + i*input->tda);
+   end_fit();
+}
+
+void Preprocessor::begin_fit(int cols){
+   samples = 0;
+   running_mean.assign(cols, 0);
+   m2.assign(cols, 0);
+}
+
+void Preprocessor::fit_row(const float *x){
+   int cols = (int)running_mean.size();
+   double n = ++samples;
+   for (int j = 0; j < cols; ++j) {
+      double delta = x[j] - running_mean[j];
+      running_mean[j] += delta/n;
+      m2[j] += delta*(x[j] - running_mean[j]);
+   }
+}
+
+void Preprocessor::end_fit(){
+   int cols = (int)running_mean.size();
+   if (mean != NULL) gsl_vector_float_free(mean);
+   if (sd != NULL) gsl_vector_float_free(sd);
+   mean = gsl_vector_float_alloc(cols);
+   sd = gsl_vector_float_alloc(cols);
+   double average = 0;
+   for (int j = 0; j < cols; ++j) {
+      gsl_vector_float_set(mean, j, (float)running_mean[j]);
+      gsl_vector_float_set(sd, j, (samples > 1) ? (float)sqrt(m2[j]/(samples - 1)) : 0);
+      average += running_mean[j]/cols;
+   }
+   
+   std::vector<int> kept;
+   for (int j = 0; j < cols; ++j) if (!masking || running_mean[j] > average) kept.push_back(j);
+   if (columns != NULL) gsl_vector_int_free(columns);
+   columns = gsl_vector_int_alloc(kept.size());
+   for (int c = 0; c < kept.size(); ++c) gsl_vector_int_set(columns, c, kept[c]);
+   
+   running_mean.clear();
+   m2.clear();
+   finish();
+}
+
+// The "mean" is min and the "sd" max - min, so finish gives offset min and scale 1/(max - min).
+void Preprocessor::set_range(int cols, float min, float max){
+   center = true;
+   sigma = 1;
+   masking = false;
+   samples = 1;
+   if (mean != NULL) gsl_vector_float_free(mean);
+   if (sd != NULL) gsl_vector_float_free(sd);
+   if (columns != NULL) gsl_vector_int_free(columns);
+   mean = gsl_vector_float_alloc(cols);
+   sd = gsl_vector_float_alloc(cols);
+   columns = gsl_vector_int_alloc(cols);
+   gsl_vector_float_set_all(mean, min);
+   gsl_vector_float_set_all(sd, max - min);
+   for (int j = 0; j < cols; ++j) gsl_vector_int_set(columns, j, j);
+   finish();
+}
+
+// Folds the statistics into an offset and scale per kept column.  Constant columns are only centered.
+void Preprocessor::finish(){
+   int kept = output_size();
+   offset.assign(kept, 0);
+   scale.assign(kept, 1);
+   for (int c = 0; c < kept; ++c) {
+      int j = gsl_vector_int_get(columns, c);
+      if (center) offset[c] = gsl_vector_float_get(mean, j);
+      float s = gsl_vector_float_get(sd, j);
+      if (sigma > 0 && s > 0) scale[c] = sigma/s;
+   }
+}
+
+void Preprocessor::apply_row(const float *x, float *y){
+   int kept = output_size();
+   const float *o = offset.data(), *s = scale.data();
+   if (kept == input_size()) {
+      for (int c = 0; c < kept; ++c) y[c] = (x[c] - o[c])*s[c];
+      return;
+   }
+   const int *cols = columns->data;
+   for (int c = 0; c < kept; ++c) y[c] = (x[cols[c]] - o[c])*s[c];
+}
+
+Input_t *Preprocessor::apply(Input_t *input){
+   if (input->size2 != input_size()) {
+      std::cerr << "Preprocessor was fit on " << input_size() << " columns, not " << input->size2 << std::endl;
+      return NULL;
+   }
+   Input_t *output = gsl_matrix_float_alloc(input->size1, output_size());
+   for (int i = 0; i < input->size1; ++i) apply_row(input->data + i*input->tda, output->data + i*output->tda);
+   return output;
+}
+
+void Preprocessor::apply_in_place(Input_t *input){
+   if (input->size2 != input_size() || output_size() != input_size()) {
+      std::cerr << "Preprocessor can't be applied in place to " << input->size2 << " columns" << std::endl;
+      return;
+   }
+   for (int i = 0; i < input->size1; ++i) {
+      float *x = input->data + i*input->tda;
+      apply_row(x, x);
+   }
+}
+
+gsl_vector_float *Preprocessor::make_mask(){
+   gsl_vector_float *mask = gsl_vector_float_calloc(input_size());
+   for (int c = 0; c < output_size(); ++c) gsl_vector_float_set(mask, gsl_vector_int_get(columns, c), 1);
+   return mask;
+}
+
+// Header (magic, version, input columns, kept columns, samples, flags, sigma), then the mean, the sd and the
+// kept column indices.
+bool Preprocessor::save(const std::string& filename){
+   FILE *file_handle = fopen(filename.c_str(), "wb");
+   if (file_handle == NULL) {
+      std::cerr << "Could not open file: " << filename << std::endl;
+      return false;
+   }
+   uint32_t header[6] = {preprocess_magic, preprocess_version, (uint32_t)input_size(), (uint32_t)output_size(),
+                         (uint32_t)samples, (uint32_t)(center | masking << 1)};
+   bool ok = fwrite(header, sizeof(header), 1, file_handle) == 1;
+   ok = ok && fwrite(&sigma, sizeof(sigma), 1, file_handle) == 1;
+   for (int j = 0; ok && j < input_size(); ++j) {
+      float stats[2] = {gsl_vector_float_get(mean, j), gsl_vector_float_get(sd, j)};
+      ok = fwrite(stats, sizeof(stats), 1, file_handle) == 1;
+   }
+   ok = ok && fwrite(columns->data, sizeof(int), output_size(), file_handle) == output_size();
+   fclose(file_handle);
+   return ok;
+}
+
+bool Preprocessor::load(const std::string& filename){
+   FILE *file_handle = fopen(filename.c_str(), "rb");
+   if (file_handle == NULL) return false;
+   
+   uint32_t header[6];
+   if (fread(header, sizeof(header), 1, file_handle) != 1 || header[0] != preprocess_magic || header[1] != preprocess_version) {
+      std::cerr << "Bad preprocessing file: " << filename << std::endl;
+      fclose(file_handle);
+      return false;
+   }
+   
+   int cols = header[2], kept = header[3];
+   gsl_vector_float *new_mean = gsl_vector_float_alloc(cols), *new_sd = gsl_vector_float_alloc(cols);
+   gsl_vector_int *new_columns = gsl_vector_int_alloc(kept);
+   bool ok = fread(&sigma, sizeof(sigma), 1, file_handle) == 1;
+   for (int j = 0; ok && j < cols; ++j) {
+      float stats[2];
+      ok = fread(stats, sizeof(stats), 1, file_handle) == 1;
+      gsl_vector_float_set(new_mean, j, stats[0]);
+      gsl_vector_float_set(new_sd, j, stats[1]);
+   }
+   ok = ok && fread(new_columns->data, sizeof(int), kept, file_handle) == kept;
+   fclose(file_handle);
+   
+   if (!ok) {
+      std::cerr << "Truncated preprocessing file: " << filename << std::endl;
+      gsl_vector_float_free(new_mean);
+      gsl_vector_float_free(new_sd);
+      gsl_vector_int_free(new_columns);
+      return false;
+   }
+   
+   if (mean != NULL) gsl_vector_float_free(mean);
+   if (sd != NULL) gsl_vector_float_free(sd);
+   if (columns != NULL) gsl_vector_int_free(columns);
+   mean = new_mean, sd = new_sd, columns = new_columns;
+   samples = header[4];
+   center = header[5] & 1;
+   masking = header[5] & 2;
+   finish();
+   return true;
+}
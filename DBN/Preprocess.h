@@ -0,0 +1,64 @@
+//
+//  Preprocess.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Preprocess__
+#define __DBN__Preprocess__
+
+#include <iostream>
+#include <vector>
+#include "Types.h"
+
+/////////////////////////////////////
+// Preprocessing
+/////////////////////////////////////
+
+// Column centering, scaling and masking as one transform, y = (x[columns] - offset)*scale.  fit is a
+// single pass over the rows that keeps a running (Welford) mean and variance for every column at once, so
+// it reads the data in memory order; begin_fit, fit_row and end_fit are the same pass for rows that come
+// from somewhere else (DataSet::fit streams them out of mapped or quantized files).  apply is a second
+// pass that centers, scales and compacts each row together.  The fitted parameters stay with the
+// preprocessor and can be saved, so data seen later (test sets, inference) goes through exactly the same
+// transform.
+class Preprocessor {
+public:
+   bool                 center;        // Subtract each column's mean.
+   float                sigma;         // Scale each column to this sd, 0 leaves the scale alone.
+   bool                 masking;       // Keep only the columns whose mean is above the average column mean.
+   
+   int                  samples;       // Rows seen by fit, 0 if it hasn't been fit.
+   gsl_vector_float     *mean;         // Column statistics from fit, over every input column.
+   gsl_vector_float     *sd;
+   gsl_vector_int       *columns;      // Input columns that are kept, in order.
+   
+   Preprocessor(bool center = true, float sigma = 0, bool masking = false);
+   ~Preprocessor();
+   
+   int input_size() {return (mean == NULL) ? 0 : (int)mean->size;}
+   int output_size() {return (columns == NULL) ? 0 : (int)columns->size;}
+   
+   void fit(Input_t *input);
+   void begin_fit(int cols);
+   void fit_row(const float *x);
+   void end_fit();
+   void set_range(int cols, float min, float max);  // (x - min)/(max - min) on every column, nothing to fit.
+   Input_t *apply(Input_t *input);                  // New rows x output_size() matrix.
+   void apply_in_place(Input_t *input);             // Only when nothing is masked out.
+   void apply_row(const float *x, float *y);
+   gsl_vector_float *make_mask();                   // 1 for kept input columns, 0 otherwise.
+   
+   bool save(const std::string& filename);
+   bool load(const std::string& filename);
+
+private:
+   std::vector<float>   offset, scale;   // Per kept column.
+   std::vector<double>  running_mean, m2;   // Welford totals while fitting.
+   
+   void finish();
+};
+
+#endif /* defined(__DBN__Preprocess__) */
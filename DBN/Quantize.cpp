@@ -0,0 +1,138 @@
+//
+//  Quantize.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "Quantize.h"
+#include "SupportFunctions.h"
+
+Quantized_Matrix::Quantized_Matrix(const std::string& filename) : rows(0), cols(0), bits(0), rms_error(0), max_error(0), matrix(NULL), scale(NULL), offset(NULL), values(NULL) {
+   file = new Mapped_File(filename);
+   Quantized_Header header;
+   if (file->data == NULL || file->size < sizeof(header)) {
+      std::cerr << "Could not map " << filename << std::endl;
+      return;
+   }
+   memcpy(&header, file->data, sizeof(header));
+   if (header.magic != quantized_matrix_magic || (header.bits != 8 && header.bits != 16)) {
+      std::cerr << filename << " is not a quantized matrix file" << std::endl;
+      return;
+   }
+   rows = header.rows, cols = header.cols, bits = header.bits;
+   rms_error = header.rms_error, max_error = header.max_error;
+   
+   size_t parameters = sizeof(header) + 2*(size_t)cols*sizeof(float);
+   if (file->size < parameters + rows*row_bytes()) {
+      std::cerr << filename << " is truncated" << std::endl;
+      return;
+   }
+   scale = (const float*)(file->data + sizeof(header));
+   offset = scale + cols;
+   values = file->data + parameters;
+}
+
+Quantized_Matrix::~Quantized_Matrix(){
+   delete file;
+}
+
+void Quantized_Matrix::dequantize_row(int row, float *dst){
+   if (bits == 8) dequantize_u8((const uint8_t*)row_data(row), scale, offset, dst, cols);
+   else dequantize_u16((const uint16_t*)row_data(row), scale, offset, dst, cols);
+}
+
+Input_t *Quantized_Matrix::dequantize(){
+   Input_t *m = gsl_matrix_float_alloc(rows, cols);
+   for (int i = 0; i < rows; ++i) dequantize_row(i, m->data + i*m->tda);
+   return m;
+}
+
+//------------------------------------------------------------------------------
+
+template <typename T>
+static bool write_rows(Input_t *m, FILE *file_handle, const std::vector<float>& scale, const std::vector<float>& offset, double& squared_error, double& max_error){
+   int cols = (int)m->size2;
+   float top = (float)((1 << (8*sizeof(T))) - 1);
+   std::vector<T> q(cols);
+   bool ok = true;
+   for (int i = 0; ok && i < m->size1; ++i) {
+      const float *x = m->data + i*m->tda;
+      for (int j = 0; j < cols; ++j) {
+         float level = (scale[j] > 0) ? floorf((x[j] - offset[j])/scale[j] + .5f) : 0;
+         q[j] = (T)std::min(std::max(level, 0.f), top);
+         double error = x[j] - (offset[j] + scale[j]*q[j]);
+         squared_error += error*error;
+         max_error = std::max(max_error, fabs(error));
+      }
+      ok = fwrite(q.data(), sizeof(T), cols, file_handle) == cols;
+   }
+   return ok;
+}
+
+// One pass for each column's range and variance, one to quantize and write.  The error is reported against
+// the data's own spread: signal to quantization noise, the variance around the column means over the mean
+// squared error.
+bool save_quantized(Input_t *m, const std::string& filename, int bits){
+   if (bits != 8 && bits != 16) {
+      std::cerr << "Can only quantize to 8 or 16 bits, not " << bits << std::endl;
+      return false;
+   }
+   int rows = (int)m->size1, cols = (int)m->size2;
+   std::vector<float> low(cols, INFINITY), high(cols, -INFINITY);
+   std::vector<double> mean(cols, 0), m2(cols, 0);
+   for (int i = 0; i < rows; ++i) {
+      const float *x = m->data + i*m->tda;
+      for (int j = 0; j < cols; ++j) {
+         low[j] = std::min(low[j], x[j]);
+         high[j] = std::max(high[j], x[j]);
+         double delta = x[j] - mean[j];
+         mean[j] += delta/(i + 1);
+         m2[j] += delta*(x[j] - mean[j]);
+      }
+   }
+   
+   float levels = (float)((1 << bits) - 1);
+   std::vector<float> scale(cols), offset(cols);
+   double variance = 0;
+   for (int j = 0; j < cols; ++j) {
+      offset[j] = (rows > 0) ? low[j] : 0;
+      scale[j] = (rows > 0) ? (high[j] - low[j])/levels : 0;
+      variance += m2[j];
+   }
+   
+   FILE *file_handle = fopen(filename.c_str(), "wb");
+   if (file_handle == NULL) {
+      std::cerr << "Could not open file: " << filename << std::endl;
+      return false;
+   }
+   Quantized_Header header = {quantized_matrix_magic, (uint32_t)rows, (uint32_t)cols, (uint32_t)bits, 0, 0};
+   bool ok = fwrite(&header, sizeof(header), 1, file_handle) == 1;
+   ok = ok && fwrite(scale.data(), sizeof(float), cols, file_handle) == cols;
+   ok = ok && fwrite(offset.data(), sizeof(float), cols, file_handle) == cols;
+   
+   double squared_error = 0, max_error = 0;
+   if (ok) ok = (bits == 8) ? write_rows<uint8_t>(m, file_handle, scale, offset, squared_error, max_error)
+                            : write_rows<uint16_t>(m, file_handle, scale, offset, squared_error, max_error);
+   
+   // The errors are only known now, so they go back into the header.
+   header.rms_error = (rows*cols > 0) ? (float)sqrt(squared_error/((double)rows*cols)) : 0;
+   header.max_error = (float)max_error;
+   ok = ok && fseek(file_handle, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file_handle) == 1;
+   fclose(file_handle);
+   if (!ok) {
+      std::cerr << "Could not write " << filename << std::endl;
+      return false;
+   }
+   
+   std::cout << "Quantized " << rows << "x" << cols << " to " << bits << " bits in " << filename << ": rms error " << header.rms_error << ", max error " << header.max_error;
+   if (squared_error > 0) std::cout << ", SQNR " << 10*log10(variance/squared_error) << " dB";
+   std::cout << std::endl;
+   return true;
+}
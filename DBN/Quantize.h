@@ -0,0 +1,61 @@
+//
+//  Quantize.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Quantize__
+#define __DBN__Quantize__
+
+#include <iostream>
+#include <stdint.h>
+#include "Types.h"
+
+class Mapped_File;
+
+/////////////////////////////////////
+// Quantized storage
+/////////////////////////////////////
+
+const uint32_t quantized_matrix_magic = 0x44424e51; // "DBNQ"
+
+// Header of a quantized matrix file.  The first three words line up with a binary matrix file, so anything
+// that only wants the shape can read either.  After it come the per column scale and offset (floats) and
+// then the rows of uint8 or uint16 values, x = offset + scale*q.
+struct Quantized_Header {
+   uint32_t    magic, rows, cols, bits;
+   float       rms_error, max_error;      // What quantizing cost, measured when the file was written.
+};
+
+// A mapped quantized matrix file.  Voxel values only need a few significant bits once each voxel has its own
+// range, so storing 8 or 16 bits instead of 32 cuts the file and the reads during training 2-4x.  Rows are
+// dequantized as they're gathered into a batch, never as a whole.
+class Quantized_Matrix {
+public:
+   int         rows, cols, bits;
+   float       rms_error, max_error;
+   Input_t     *matrix;                   // Shape-only header (no data) that a DataSet hands out for this file.
+   
+   Quantized_Matrix(const std::string& filename);
+   ~Quantized_Matrix();
+   
+   bool valid() {return values != NULL;}
+   Mapped_File *mapping() {return file;}
+   size_t row_bytes() {return (size_t)cols*bits/8;}
+   const char *row_data(int row) {return values + row*row_bytes();}
+   void dequantize_row(int row, float *dst);
+   Input_t *dequantize();                 // The whole matrix in memory.
+   
+private:
+   Mapped_File *file;
+   const float *scale, *offset;
+   const char  *values;
+};
+
+// Writes m with 8 or 16 bits per value and a scale and offset per column, and reports the reconstruction
+// error that introduces.
+bool save_quantized(Input_t *m, const std::string& filename, int bits = 8);
+
+#endif /* defined(__DBN__Quantize__) */
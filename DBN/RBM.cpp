@@ -13,7 +13,64 @@
 
 RBM::RBM () {free_energy = 0;}
 
+// Mean free energy of the current visible samples.  Every visible layer adds its own terms once, every hidden
+// layer sums the input from all of its connections before its reduction.
 void RBM::getFreeEnergy(){
+   std::vector<Layer*> visibles, hiddens;
+   for (auto edge:edges) {
+      if (std::find(visibles.begin(), visibles.end(), edge->from) == visibles.end()) visibles.push_back(edge->from);
+      if (std::find(hiddens.begin(), hiddens.end(), edge->to) == hiddens.end()) hiddens.push_back(edge->to);
+   }
+   if (visibles.size() == 0) return;
+   
+   int n = visibles[0]->batchsize;
+   gsl_vector_float *energy = gsl_vector_float_calloc(n);
+   for (auto visible:visibles) visible->unit_energy(visible->samples, energy);
+   for (auto hidden:hiddens) {
+      gsl_matrix_float *x = gsl_matrix_float_calloc(hidden->nodenum, n);
+      for (auto edge:edges) if (edge->to == hidden)
+         gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, ((Connection*)edge)->weights, edge->from->samples, 1, x);
+      hidden->freeEnergy_contibution(x, energy);
+      gsl_matrix_float_free(x);
+   }
+   free_energy = gsl_stats_float_mean(energy->data, energy->stride, energy->size);
+   gsl_vector_float_free(energy);
+}
+
+// Mean free energy over rows of data (samples x visible), transport_chunk rows at a time.  With rows set,
+// only that many rows, evenly spaced through data, are used.  Single connection RBMs only.
+float RBM::free_energy_of(Input_t *data, int rows){
+   if (edges.size() != 1) {
+      std::cerr << "Free energy of data only works for single connection RBMs" << std::endl;
+      return 0;
+   }
+   Connection *connection = (Connection*)edges[0];
+   
+   int stride = 1;
+   if (rows <= 0 || rows > data->size1) rows = (int)data->size1;
+   else stride = (int)data->size1/rows;
+   
+   int chunk = std::min(transport_chunk, rows);
+   gsl_matrix_float *v = gsl_matrix_float_alloc(connection->from->nodenum, chunk);
+   gsl_matrix_float *x = gsl_matrix_float_alloc(connection->to->nodenum, chunk);
+   gsl_vector_float *energy = gsl_vector_float_alloc(chunk);
+   
+   double total = 0;
+   for (int start = 0; start < rows; start += chunk) {
+      int n = std::min(chunk, rows - start);
+      gsl_matrix_float_view vv = gsl_matrix_float_submatrix(v, 0, 0, v->size1, n);
+      gsl_matrix_float_view xv = gsl_matrix_float_submatrix(x, 0, 0, x->size1, n);
+      gsl_vector_float_view ev = gsl_vector_float_subvector(energy, 0, n);
+      gsl_matrix_float_view block = gsl_matrix_float_view_array_with_tda(data->data + start*stride*data->tda, n, data->size2, stride*data->tda);
+      gsl_matrix_float_transpose_memcpy(&vv.matrix, &block.matrix);
+      connection->getFreeEnergy(&vv.matrix, &xv.matrix, &ev.vector);
+      for (int j = 0; j < n; ++j) total += gsl_vector_float_get(energy, j);
+   }
+   
+   gsl_matrix_float_free(v);
+   gsl_matrix_float_free(x);
+   gsl_vector_float_free(energy);
+   return (float)(total/rows);
 }
 
 void RBM::learn(){
@@ -22,6 +22,7 @@ public:
    RBM();
    
    void getFreeEnergy();
+   float free_energy_of(Input_t *data, int rows = 0);
    void gibbs_HV();
    void gibbs_VH();
 
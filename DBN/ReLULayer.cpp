@@ -8,6 +8,7 @@
 
 #include "Layers.h"
 #include "IO.h"
+#include "Preprocess.h"
 
 
 void ReLULayer::getExpectations(){
@@ -29,7 +30,7 @@ void ReLULayer::sample(){
    for (int i = 0; i < nodenum; ++i){
       for (int j = 0; j < batchsize; ++j){
          float exp = gsl_matrix_float_get(expectations, i, j);
-         float sam = fmaxf(0, exp + gsl_ran_gaussian(r, sigmoid(exp)));
+         float sam = fmaxf(0, exp + gsl_ran_gaussian(context->rng, sigmoid(exp)));
          gsl_matrix_float_set(samples, i, j, sam);
       }
    }
@@ -37,21 +38,49 @@ void ReLULayer::sample(){
    
 }
 
+void ReLULayer::fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta){
+   for (int i = 0; i < x->size1; ++i){
+      float bias = gsl_vector_float_get(biases, i);
+      float *act = x->data + i*x->tda;
+      float *exp = exps->data + i*exps->tda;
+      float *sam = (samps == NULL) ? NULL : samps->data + i*samps->tda;
+      for (int j = 0; j < x->size2; ++j){
+         exp[j] = softplus(beta*(act[j] + bias));
+         if (sam == NULL) continue;
+         sam[j] = fmaxf(0, exp[j] + gsl_ran_gaussian(rng, sigmoid(exp[j])));
+         if (noisy) sam[j] *= (gsl_rng_uniform(rng) >= noise);
+      }
+   }
+}
+
 void ReLULayer::update(ContrastiveDivergence *teacher){
    Layer::update(teacher);
 }
 
-float ReLULayer :: freeEnergy_contibution() {
-   return 0;
+// Same as binary units, since the NReLU expectation is the softplus of the input.
+void ReLULayer::freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy){
+   for (int i = 0; i < x->size1; ++i){
+      float bias = gsl_vector_float_get(biases, i);
+      const float *act = x->data + i*x->tda;
+      for (int j = 0; j < x->size2; ++j) energy->data[j*energy->stride] -= softplus(act[j] + bias);
+   }
+}
+
+// Treated like binary units here too.
+double ReLULayer::log_partition(const double *x){
+   double logZ = 0;
+   for (int i = 0; i < nodenum; ++i) logZ += softplus(gsl_vector_float_get(biases, i) + (x ? x[i] : 0));
+   return logZ;
 }
 
 //The input needs to be shaped depending on the type of visible layer.
 void ReLULayer::shapeInput(DataSet* data){
-   Input_t *input = data->train;
+   // Scaled to [0,1] with train's range, through preprocess so mapped and quantized sets work too.
    float min, max;
-   gsl_matrix_float_minmax(input, &min, &max);
-   gsl_matrix_float_add_constant(input, -min);
-   gsl_matrix_float_scale(input, (float)1/((float)(max-min)));
+   data->train_range(min, max);
+   Preprocessor *scale = new Preprocessor;
+   scale->set_range(data->columns_of(data->train), min, max);
+   data->preprocess(scale);
 }
 
 float ReLULayer::reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_float *modelMat){
@@ -8,6 +8,7 @@
 
 #include "Layers.h"
 #include "IO.h"
+#include "Preprocess.h"
 
 void SigmoidLayer::getExpectations(){
    //Apply sigmoid.  Might want to pass a general functor later
@@ -22,13 +23,28 @@ void SigmoidLayer::getExpectations(){
 void SigmoidLayer::sample(){
    for (int i = 0; i < nodenum; ++i){
       for (int j = 0; j < batchsize; ++j){
-         float u = gsl_rng_uniform(r);
+         float u = gsl_rng_uniform(context->rng);
          float sample = (float)(gsl_matrix_float_get(expectations, i, j) > u);
          gsl_matrix_float_set(samples, i, j, sample);
       }
    }
 }
 
+void SigmoidLayer::fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta){
+   for (int i = 0; i < x->size1; ++i){
+      float bias = gsl_vector_float_get(biases, i);
+      float *act = x->data + i*x->tda;
+      float *exp = exps->data + i*exps->tda;
+      float *sam = (samps == NULL) ? NULL : samps->data + i*samps->tda;
+      for (int j = 0; j < x->size2; ++j){
+         exp[j] = sigmoid(beta*(act[j] + bias));
+         if (sam == NULL) continue;
+         sam[j] = (float)(exp[j] > gsl_rng_uniform(rng));
+         if (noisy) sam[j] *= (gsl_rng_uniform(rng) >= noise);
+      }
+   }
+}
+
 void SigmoidLayer::update(ContrastiveDivergence *teacher){
    Layer::update(teacher);
 }
@@ -45,49 +61,27 @@ float SigmoidLayer::reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_flo
    return (float)reconstruction_cost/(float)batchsize;
 }
 
-float SigmoidLayer :: freeEnergy_contibution() {
-   /*expandBiases();
-   
-   //Computing x = W v + b
-   gsl_matrix_float *x_j = gsl_matrix_float_alloc(up->nodenum_, up->batchsize_);
-   gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, weights_, activations_, 0, x_j);
-   gsl_matrix_float_add(x_j, batchbiases_);
-   
-   gsl_vector_float *vBiasTerm = gsl_vector_float_alloc(batchsize_);
-   gsl_vector_float *identity = gsl_vector_float_alloc(nodenum_);
-   gsl_vector_float_set_all(identity, 1);
-   gsl_vector_float *hterm = gsl_vector_float_alloc(batchsize_);
-   
-   //Compute v.a
-   gsl_blas_sgemv(CblasTrans, 1, activations_,biases_, 0, vBiasTerm);
-   
-   // x_j -> softplus x_j
-   for (int i = 0; i < up->nodenum_; ++i)
-      for (int j = 0; j < up->batchsize_; ++j){
-         float val = softplus(gsl_matrix_float_get(x_j, i, j));
-         gsl_matrix_float_set(x_j, i, j, val);
-      }
-   // Then get x.hterm
-   gsl_blas_sgemv(CblasNoTrans, 1, x_j, identity, 0, hterm);
-   
-   // add hterm and vbias term
-   gsl_vector_float_add(hterm, vBiasTerm);
-   
-   freeEnergy_ = -gsl_stats_float_mean(hterm->data, hterm->stride, hterm->size);
-   
-   //Free memory
-   gsl_vector_float_free(vBiasTerm);
-   gsl_vector_float_free(hterm);
-   gsl_matrix_float_free(x_j);
-   gsl_vector_float_free(identity);*/
-   return 0;
+// Binary units: -sum_i softplus(x_i + b_i).  Row at a time so the reduction runs along memory.
+void SigmoidLayer::freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy){
+   for (int i = 0; i < x->size1; ++i){
+      float bias = gsl_vector_float_get(biases, i);
+      const float *act = x->data + i*x->tda;
+      for (int j = 0; j < x->size2; ++j) energy->data[j*energy->stride] -= softplus(act[j] + bias);
+   }
+}
+
+double SigmoidLayer::log_partition(const double *x){
+   double logZ = 0;
+   for (int i = 0; i < nodenum; ++i) logZ += softplus(gsl_vector_float_get(biases, i) + (x ? x[i] : 0));
+   return logZ;
 }
 
 //The input needs to be shaped depending on the type of visible layer.
 void SigmoidLayer::shapeInput(DataSet *data){
-   Input_t *input = data->train;
+   // Scaled to [0,1] with train's range, through preprocess so mapped and quantized sets work too.
    float min, max;
-   gsl_matrix_float_minmax(input, &min, &max);
-   gsl_matrix_float_add_constant(input, -min);
-   gsl_matrix_float_scale(input, (float)1/((float)(max-min)));
+   data->train_range(min, max);
+   Preprocessor *scale = new Preprocessor;
+   scale->set_range(data->columns_of(data->train), min, max);
+   data->preprocess(scale);
 }
\ No newline at end of file
@@ -9,31 +9,53 @@
 #include "Layers.h"
 #include "IO.h"
 
+// Apply continuous softmax down each column, shifted by the column's max so the exponentials can't overflow.
 void SoftmaxLayer::getExpectations(){
-   //Apply continuous softmax.
-   for (int i = 0; i < nodenum; ++i){
-      for (int j = 0; j < batchsize; ++j){
-         float denom = 0;
-         for (int c = 0; c < nodenum; ++c) {
-            float c_val = gsl_matrix_float_get(activations, c, j);
-            denom += expf(c_val);
-         }
-         float num = gsl_matrix_float_get(activations, i, j);
-         gsl_matrix_float_set(expectations, i, j, num/denom);
+   for (int j = 0; j < batchsize; ++j){
+      float top = -INFINITY;
+      for (int c = 0; c < nodenum; ++c) top = fmaxf(top, gsl_matrix_float_get(activations, c, j));
+      float denom = 0;
+      for (int c = 0; c < nodenum; ++c) {
+         float e = expf(gsl_matrix_float_get(activations, c, j) - top);
+         gsl_matrix_float_set(expectations, c, j, e);
+         denom += e;
       }
+      for (int i = 0; i < nodenum; ++i)
+         gsl_matrix_float_set(expectations, i, j, gsl_matrix_float_get(expectations, i, j)/denom);
    }
 }
 
 void SoftmaxLayer::sample(){
    for (int i = 0; i < nodenum; ++i){
       for (int j = 0; j < batchsize; ++j){
-         float u = gsl_rng_uniform(r);
+         float u = gsl_rng_uniform(context->rng);
          float sample = (float)(gsl_matrix_float_get(expectations, i, j) > u);
          gsl_matrix_float_set(samples, i, j, sample);
       }
    }
 }
 
+// Column at a time, since every unit in a column shares the max and the denominator.  Both are done
+// before anything is written, so this works in place.
+void SoftmaxLayer::fused_activation(gsl_matrix_float *x, gsl_matrix_float *exps, gsl_matrix_float *samps, const gsl_rng *rng, float beta){
+   for (int j = 0; j < x->size2; ++j){
+      float top = -INFINITY;
+      for (int c = 0; c < x->size1; ++c)
+         top = fmaxf(top, beta*(gsl_matrix_float_get(x, c, j) + gsl_vector_float_get(biases, c)));
+      float denom = 0;
+      for (int c = 0; c < x->size1; ++c)
+         denom += expf(beta*(gsl_matrix_float_get(x, c, j) + gsl_vector_float_get(biases, c)) - top);
+      for (int i = 0; i < x->size1; ++i){
+         float exp = expf(beta*(gsl_matrix_float_get(x, i, j) + gsl_vector_float_get(biases, i)) - top)/denom;
+         gsl_matrix_float_set(exps, i, j, exp);
+         if (samps == NULL) continue;
+         float sample = (float)(exp > gsl_rng_uniform(rng));
+         if (noisy) sample *= (gsl_rng_uniform(rng) >= noise);
+         gsl_matrix_float_set(samps, i, j, sample);
+      }
+   }
+}
+
 void SoftmaxLayer::update(ContrastiveDivergence *teacher){
    Layer::update(teacher);
 }
@@ -52,7 +74,23 @@ float SoftmaxLayer::reconstructionCost(gsl_matrix_float *dataMat, gsl_matrix_flo
    return reconstruction_cost;
 }
 
-float SoftmaxLayer :: freeEnergy_contibution() {return 0;}
+// One of nodenum: -log sum_c exp(x_c + b_c), shifted by the max so it doesn't overflow.
+void SoftmaxLayer::freeEnergy_contibution(gsl_matrix_float *x, gsl_vector_float *energy){
+   for (int j = 0; j < x->size2; ++j){
+      float top = -INFINITY;
+      for (int c = 0; c < x->size1; ++c) top = fmaxf(top, gsl_matrix_float_get(x, c, j) + gsl_vector_float_get(biases, c));
+      float sum = 0;
+      for (int c = 0; c < x->size1; ++c) sum += expf(gsl_matrix_float_get(x, c, j) + gsl_vector_float_get(biases, c) - top);
+      energy->data[j*energy->stride] -= top + logf(sum);
+   }
+}
+
+double SoftmaxLayer::log_partition(const double *x){
+   double top = -INFINITY, sum = 0;
+   for (int c = 0; c < nodenum; ++c) top = std::max(top, gsl_vector_float_get(biases, c) + (x ? x[c] : 0));
+   for (int c = 0; c < nodenum; ++c) sum += exp(gsl_vector_float_get(biases, c) + (x ? x[c] : 0) - top);
+   return top + log(sum);
+}
 
 //The input needs to be shaped depending on the type of visible layer.
 void SoftmaxLayer::shapeInput(DataSet *data){
@@ -7,16 +7,23 @@
 //
 
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "SupportFunctions.h"
 
-gsl_vector_int *makeShuffleList(int length){
+gsl_vector_int *makeShuffleList(int length, const gsl_rng *rng){
    
    
    gsl_vector_int *list = gsl_vector_int_alloc(length);
    
-   for (int i = 0; i < 10; ++i) gsl_vector_int_set(list, i, i);
+   for (int i = 0; i < length; ++i) gsl_vector_int_set(list, i, i);
    
-   gsl_ran_shuffle(r, list->data, list->size, sizeof(int));
+   gsl_ran_shuffle(rng, list->data, list->size, sizeof(int));
    
    return list;
 }
@@ -80,10 +87,184 @@ std::string readTextFile(const std::string& filename)
    return source;
 }
 
-void save_gsl_matrix(gsl_matrix_float *m){
-   std::string path = plotpath + "test.out";
+void save_gsl_matrix(gsl_matrix_float *m, const std::string& filename){
    FILE *file_handle;
-   file_handle = fopen(path.c_str(), "w");
+   file_handle = fopen(filename.c_str(), "w");
    gsl_matrix_float_fprintf(file_handle, m, "%.5g");
    fclose(file_handle);
-}
\ No newline at end of file
+}
+
+// Binary matrices are a small header (magic, rows, cols) followed by the rows as raw float32.  Much
+// faster than the text dump above and exact, so it's what the caches use.
+bool save_gsl_matrix_binary(gsl_matrix_float *m, const std::string& filename){
+   FILE *file_handle = fopen(filename.c_str(), "wb");
+   if (file_handle == NULL) {
+      std::cerr << "Could not open file: " << filename << std::endl;
+      return false;
+   }
+   uint32_t header[3] = {binary_matrix_magic, (uint32_t)m->size1, (uint32_t)m->size2};
+   bool ok = fwrite(header, sizeof(uint32_t), 3, file_handle) == 3;
+   for (int i = 0; ok && i < m->size1; ++i)
+      ok = fwrite(m->data + i*m->tda, sizeof(float), m->size2, file_handle) == m->size2;
+   fclose(file_handle);
+   return ok;
+}
+
+gsl_matrix_float *load_gsl_matrix_binary(const std::string& filename){
+   FILE *file_handle = fopen(filename.c_str(), "rb");
+   if (file_handle == NULL) return NULL;
+   
+   uint32_t header[3];
+   if (fread(header, sizeof(uint32_t), 3, file_handle) != 3 || header[0] != binary_matrix_magic) {
+      std::cerr << "Bad binary matrix file: " << filename << std::endl;
+      fclose(file_handle);
+      return NULL;
+   }
+   
+   gsl_matrix_float *m = gsl_matrix_float_alloc(header[1], header[2]);
+   if (fread(m->data, sizeof(float), m->size1*m->size2, file_handle) != m->size1*m->size2) {
+      std::cerr << "Truncated binary matrix file: " << filename << std::endl;
+      gsl_matrix_float_free(m);
+      m = NULL;
+   }
+   fclose(file_handle);
+   return m;
+}
+
+// Maps the file and copies it into dest, which has to already be the right shape.
+bool load_gsl_matrix_binary(const std::string& filename, gsl_matrix_float *dest){
+   Mapped_File file(filename);
+   if (file.data == NULL) return false;
+   
+   uint32_t header[3];
+   if (file.size < sizeof(header)) return false;
+   memcpy(header, file.data, sizeof(header));
+   if (header[0] != binary_matrix_magic || header[1] != dest->size1 || header[2] != dest->size2
+       || file.size < sizeof(header) + dest->size1*dest->size2*sizeof(float)) {
+      std::cerr << "Binary matrix file " << filename << " doesn't match a " << dest->size1 << "x" << dest->size2 << " matrix" << std::endl;
+      return false;
+   }
+   
+   file.advise_sequential();
+   const float *src = (const float*)(file.data + sizeof(header));
+   for (int i = 0; i < dest->size1; ++i)
+      memcpy(dest->data + i*dest->tda, src + i*dest->size2, dest->size2*sizeof(float));
+   return true;
+}
+
+// FNV-1a over the raw bytes.  Used to key caches on parameter values, so chaining calls is fine.
+static uint64_t fnv1a(const void *data, size_t bytes, uint64_t hash){
+   const unsigned char *p = (const unsigned char*)data;
+   for (size_t i = 0; i < bytes; ++i) {
+      hash ^= p[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+
+uint64_t hash_bytes(const void *data, size_t bytes, uint64_t hash){
+   return fnv1a(data, bytes, hash);
+}
+
+uint64_t hash_gsl(gsl_matrix_float *m, uint64_t hash){
+   uint64_t dims[2] = {m->size1, m->size2};
+   hash = fnv1a(dims, sizeof(dims), hash);
+   for (int i = 0; i < m->size1; ++i) hash = fnv1a(m->data + i*m->tda, m->size2*sizeof(float), hash);
+   return hash;
+}
+
+uint64_t hash_gsl(gsl_vector_float *v, uint64_t hash){
+   for (int i = 0; i < v->size; ++i) {
+      float val = gsl_vector_float_get(v, i);
+      hash = fnv1a(&val, sizeof(val), hash);
+   }
+   return hash;
+}
+
+// dst[i] = scale*src[i].  SSE2 widens 16 bytes at a time to four float vectors; the tail (and anything
+// without SSE2) is done one at a time.
+void u8_to_float(const uint8_t *src, float *dst, size_t n, float scale){
+   size_t i = 0;
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128();
+   const __m128 s = _mm_set1_ps(scale);
+   for (; i + 16 <= n; i += 16) {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), s));
+      _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), s));
+      _mm_storeu_ps(dst + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), s));
+      _mm_storeu_ps(dst + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), s));
+   }
+#endif
+   for (; i < n; ++i) dst[i] = scale*(float)src[i];
+}
+
+// dst = offset + scale*src with a scale and offset per element, for quantized rows.
+#ifdef __SSE2__
+static inline void dequantize_4(__m128i q, const float *scale, const float *offset, float *dst){
+   _mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(offset), _mm_mul_ps(_mm_cvtepi32_ps(q), _mm_loadu_ps(scale))));
+}
+#endif
+
+void dequantize_u8(const uint8_t *src, const float *scale, const float *offset, float *dst, size_t n){
+   size_t i = 0;
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128();
+   for (; i + 16 <= n; i += 16) {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      dequantize_4(_mm_unpacklo_epi16(lo, zero), scale + i, offset + i, dst + i);
+      dequantize_4(_mm_unpackhi_epi16(lo, zero), scale + i + 4, offset + i + 4, dst + i + 4);
+      dequantize_4(_mm_unpacklo_epi16(hi, zero), scale + i + 8, offset + i + 8, dst + i + 8);
+      dequantize_4(_mm_unpackhi_epi16(hi, zero), scale + i + 12, offset + i + 12, dst + i + 12);
+   }
+#endif
+   for (; i < n; ++i) dst[i] = offset[i] + scale[i]*(float)src[i];
+}
+
+void dequantize_u16(const uint16_t *src, const float *scale, const float *offset, float *dst, size_t n){
+   size_t i = 0;
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128();
+   for (; i + 8 <= n; i += 8) {
+      __m128i words = _mm_loadu_si128((const __m128i*)(src + i));
+      dequantize_4(_mm_unpacklo_epi16(words, zero), scale + i, offset + i, dst + i);
+      dequantize_4(_mm_unpackhi_epi16(words, zero), scale + i + 4, offset + i + 4, dst + i + 4);
+   }
+#endif
+   for (; i < n; ++i) dst[i] = offset[i] + scale[i]*(float)src[i];
+}
+
+Mapped_File::Mapped_File(const std::string& filename) : data(NULL), size(0) {
+   int fd = open(filename.c_str(), O_RDONLY);
+   if (fd < 0) return;
+   struct stat st;
+   if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+         data = (const char*)map;
+         size = st.st_size;
+      }
+   }
+   close(fd);
+}
+
+Mapped_File::~Mapped_File(){
+   if (data != NULL) munmap((void*)data, size);
+}
+
+void Mapped_File::advise_sequential(){
+   if (data != NULL) madvise((void*)data, size, MADV_SEQUENTIAL);
+}
+
+void Mapped_File::advise(const void *start, size_t length, int advice){
+   if (!contains(start)) return;
+   static const size_t page = sysconf(_SC_PAGESIZE);
+   size_t offset = (const char*)start - data;
+   size_t first = offset - offset%page;
+   length = std::min(offset + length, size) - first;
+   madvise((void*)(data + first), length, advice);
+}
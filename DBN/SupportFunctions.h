@@ -9,13 +9,39 @@
 #ifndef DBN_SupportFunctions_h
 #define DBN_SupportFunctions_h
 #include "Types.h"
+#include <stdint.h>
 
-gsl_vector_int *makeShuffleList(int length);
+gsl_vector_int *makeShuffleList(int length, const gsl_rng *rng);
 void print_gsl(gsl_vector_float *v);
 void print_gsl(gsl_vector_int *v);
 void print_gsl(gsl_matrix_float *m);
 void load_vec_into_matrix(gsl_vector_float *from, gsl_matrix_float *to);
 void load_vec_into_matrix(gsl_matrix_float *from, gsl_matrix_float *to);
 std::string readTextFile(const std::string& filename);
-void save_gsl_matrix(gsl_matrix_float *m);
+void save_gsl_matrix(gsl_matrix_float *m, const std::string& filename);
+const uint32_t binary_matrix_magic = 0x44424e4d; // "DBNM", then rows and cols as uint32 and the floats
+bool save_gsl_matrix_binary(gsl_matrix_float *m, const std::string& filename);
+gsl_matrix_float *load_gsl_matrix_binary(const std::string& filename);
+bool load_gsl_matrix_binary(const std::string& filename, gsl_matrix_float *dest);
+uint64_t hash_bytes(const void *data, size_t bytes, uint64_t hash = 14695981039346656037ULL);
+uint64_t hash_gsl(gsl_matrix_float *m, uint64_t hash = 14695981039346656037ULL);
+uint64_t hash_gsl(gsl_vector_float *v, uint64_t hash = 14695981039346656037ULL);
+void u8_to_float(const uint8_t *src, float *dst, size_t n, float scale = 1);
+void dequantize_u8(const uint8_t *src, const float *scale, const float *offset, float *dst, size_t n);
+void dequantize_u16(const uint16_t *src, const float *scale, const float *offset, float *dst, size_t n);
+
+// Read-only memory map of a whole file.  data is NULL if the file couldn't be opened or mapped.  The pages
+// are always clean, so the kernel can drop them under memory pressure and read them back later.
+class Mapped_File {
+public:
+   const char *data;
+   size_t size;
+   
+   Mapped_File(const std::string& filename);
+   ~Mapped_File();
+   
+   bool contains(const void *p) {return data != NULL && (const char*)p >= data && (const char*)p < data + size;}
+   void advise_sequential();
+   void advise(const void *start, size_t length, int advice);   // madvise on the pages covering the range
+};
 #endif
@@ -14,7 +14,7 @@ float sigmoid(float x){
 }
 
 double softplus(float x){
-   return log(1+exp(x));
+   return (x > 0) ? x + log1p(exp(-x)) : log1p(exp(x));
 }
 
 float gaussian(float x){
@@ -13,6 +13,9 @@
 #include "Layers.h"
 #include "Connections.h"
 #include "Monitors.h"
+#include "Threads.h"
+#include "Checkpoint.h"
+#include "IO.h"
 
 void Teacher::multiply_rate() {
    learning_multiplier *=2;
@@ -31,6 +34,22 @@ ContrastiveDivergence::ContrastiveDivergence(float momentum, int k, int batchsiz
 
 void ContrastiveDivergence::getStats(RBM *rbm){
    
+   // A plain visible-hidden RBM runs the chain straight on the layer buffers with the fused sweep.  The
+   // transmit path below is for anything more complicated.
+   if (rbm->edges.size() == 1) {
+      Connection *connection = (Connection*)rbm->edges[0];
+      Layer *visible = connection->from;
+      Layer *hidden = connection->to;
+      
+      rbm->catch_stats(POS);
+      for (int g = 0; g < k; ++g)
+         connection->gibbs_sweep(visible->samples, visible->expectations, hidden->samples, hidden->expectations, hidden->context->rng);
+      visible->status = SAMPLED;
+      hidden->status = SAMPLED;
+      rbm->catch_stats(NEG);
+      return;
+   }
+   
    rbm->make_bottom_to_top_transmit_list();
    // Positive stats
    rbm->catch_stats(POS);
@@ -41,10 +60,37 @@ void ContrastiveDivergence::getStats(RBM *rbm){
    rbm->catch_stats(NEG);
 }
 
+// The next training batch into the RBM's layers, 0 at the end of the epoch.
+int ContrastiveDivergence::next_batch(RBM *rbm){
+   rbm->make_input_to_top_transmit_list();
+   return rbm->transmit(FORWARD);
+}
+
+void ContrastiveDivergence::train_batch(RBM *rbm){
+   // Gets statistics by performing CD.
+   getStats(rbm);
+   
+   // Update the parameters.
+   rbm->update(this);
+   
+   // Fresh batch matrices for the next one; the persistent negative stats are views that go with them.
+   rbm->make_batch(batchsize);
+}
+
+// The epoch loop every CD teacher shares: resuming from the checkpointer, checkpoints every so many batches
+// and at the end of each epoch, and the monitor (or the epoch count, without one) deciding when to stop.
+// next_batch and train_batch are all a teacher needs to change.
 void ContrastiveDivergence::teachRBM(RBM *rbm){
    learning = true;
    int epoch = 0;
+   int resume_batch = 1, resume_index = 0;
    learning_multiplier = 1;
+   if (checkpointer != NULL && checkpointer->resuming) {
+      epoch = checkpointer->epoch;
+      resume_batch = checkpointer->batch;
+      resume_index = checkpointer->index;
+      learning_multiplier = checkpointer->learning_multiplier;
+   }
    while (learning){
       
       rbm->make_batch(batchsize);
@@ -57,29 +103,258 @@ void ContrastiveDivergence::teachRBM(RBM *rbm){
       
       rbm->init_data();
       // Loop through the input
-      int batchnumber = 1;
-      rbm->make_input_to_top_transmit_list();
-      while ( rbm->transmit(FORWARD) ){
+      int batchnumber = resume_batch;
+      for (auto input:rbm->inputs) input->dataset->index = resume_index;
+      resume_batch = 1, resume_index = 0;
+      if (checkpointer != NULL && checkpointer->resuming) checkpointer->restore(rbm, this);
+      while (next_batch(rbm)){
          
-         // Gets statistics by performing CD.
-         getStats(rbm);
-         
-         // Update the parameters.
-         rbm->update(this);
+         train_batch(rbm);
          
          // And monitor
          if (batchnumber%100 == 0) {
-            //monitor->update();
             std::cout << std::flush;
             std::cout << "Batch number: " << batchnumber << std::endl;
-            //monitor->update();
          }
          batchnumber+=1;
-         rbm->make_batch(batchsize);
-         rbm->make_input_to_top_transmit_list();
+         if (checkpointer != NULL && checkpointer->every > 0 && batchnumber%checkpointer->every == 0)
+            checkpointer->save(rbm, this, epoch, batchnumber, rbm->inputs.size() ? rbm->inputs[0]->dataset->index : 0, learning_multiplier);
       }
       ++epoch;
-      monitor->update();
+      if (checkpointer != NULL) checkpointer->save(rbm, this, epoch, 1, 0, learning_multiplier);
+      // Without a monitor to decide when to stop, stop after epochs.
+      if (monitor != NULL) monitor->update();
+      else if (epoch >= epochs) learning = false;
+   }
+   
+}
+
+//------------------------------------------------------------------------------
+
+Persistent_CD::Persistent_CD(float momentum, int k, int batchsize, int epochs, int particles) : ContrastiveDivergence(momentum, k, batchsize, epochs), particles(particles)
+{
+   pool_owner = NULL;
+   pool = NULL;
+   
+   // The bias updates sum over the pool as well as the batch.
+   gsl_vector_float_free(identity);
+   identity = gsl_vector_float_alloc(std::max(batchsize, particles));
+   gsl_vector_float_set_all(identity, 1);
+}
+
+// Starts the chains from the current data batch (repeated if the pool is bigger than the batch).
+void Persistent_CD::init_pool(RBM *rbm){
+   Connection *connection = (Connection*)rbm->edges[0];
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   
+   if (pool != NULL) {
+      gsl_matrix_float_free(v_samples);
+      gsl_matrix_float_free(v_exps);
+      gsl_matrix_float_free(h_samples);
+      gsl_matrix_float_free(h_exps);
+      gsl_block_float_free(pool);
+   }
+   
+   int v_size = visible->nodenum*particles, h_size = hidden->nodenum*particles;
+   pool = gsl_block_float_alloc(2*(v_size + h_size));
+   v_samples = gsl_matrix_float_alloc_from_block(pool, 0, visible->nodenum, particles, particles);
+   v_exps = gsl_matrix_float_alloc_from_block(pool, v_size, visible->nodenum, particles, particles);
+   h_samples = gsl_matrix_float_alloc_from_block(pool, 2*v_size, hidden->nodenum, particles, particles);
+   h_exps = gsl_matrix_float_alloc_from_block(pool, 2*v_size + h_size, hidden->nodenum, particles, particles);
+   
+   for (int p = 0; p < particles; ++p)
+      for (int i = 0; i < visible->nodenum; ++i)
+         gsl_matrix_float_set(v_samples, i, p, gsl_matrix_float_get(visible->samples, i, p%visible->batchsize));
+   
+   gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, connection->weights, v_samples, 0, h_exps);
+   hidden->fused_activation(h_exps, h_exps, h_samples, hidden->context->rng);
+   pool_owner = rbm;
+}
+
+void Persistent_CD::advance_chains(Connection *connection){
+   for (int g = 0; g < k; ++g) connection->gibbs_sweep(v_samples, v_exps, h_samples, h_exps, connection->to->context->rng);
+}
+
+void Persistent_CD::getStats(RBM *rbm){
+   if (rbm->edges.size() != 1) {
+      ContrastiveDivergence::getStats(rbm);
+      return;
+   }
+   
+   Connection *connection = (Connection*)rbm->edges[0];
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   
+   // Positive stats
+   rbm->catch_stats(POS);
+   
+   if (pool_owner != rbm) init_pool(rbm);
+   advance_chains(connection);
+   
+   // Negative stats are read straight out of the pool: visible samples and hidden expectations, same as
+   // catch_stats(NEG).  The views only free themselves when the layers re-batch.
+   gsl_matrix_float_free(visible->stat2);
+   gsl_matrix_float_free(hidden->stat2);
+   visible->stat2 = gsl_matrix_float_alloc_from_block(pool, v_samples->data - pool->data, visible->nodenum, particles, particles);
+   hidden->stat2 = gsl_matrix_float_alloc_from_block(pool, h_exps->data - pool->data, hidden->nodenum, particles, particles);
+   connection->stat3 = hidden->stat2;
+   connection->stat4 = visible->stat2;
+}
+
+// The particle pool.  The chains use the context rng, which the checkpoint has anyway.
+void Persistent_CD::checkpoint_state(RBM *rbm, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters){
+   if (rbm->edges.size() != 1) return;
+   if (pool_owner != rbm) init_pool(rbm);
+   gsl_matrix_float *chains[] = {v_samples, v_exps, h_samples, h_exps};
+   for (auto m:chains) matrices.push_back(m);
+}
+
+//------------------------------------------------------------------------------
+
+Parallel_Tempering::Parallel_Tempering(float momentum, int k, int batchsize, int epochs, int particles, int replicas, float min_beta, Thread_Pool *threads) : Persistent_CD(momentum, k, batchsize, epochs, particles), replicas(std::max(replicas, 2)), threads(threads)
+{
+   for (int m = 0; m < this->replicas; ++m) {
+      betas.push_back(powf(min_beta, (float)m/(float)(this->replicas - 1)));
+      rngs.push_back(context->new_stream());
+   }
+   attempts.assign(this->replicas - 1, 0);
+   accepts.assign(this->replicas - 1, 0);
+   acceptance = gsl_vector_float_calloc(this->replicas - 1);
+   updates = 0;
+   
+   if (this->threads == NULL) this->threads = context->pool();
+}
+
+// Every replica starts from the data batch, with the hiddens sampled at its own temperature.
+void Parallel_Tempering::init_pool(RBM *rbm){
+   Connection *connection = (Connection*)rbm->edges[0];
+   Layer *visible = connection->from;
+   Layer *hidden = connection->to;
+   
+   if (pool != NULL) {
+      for (int m = 0; m < replicas; ++m) {
+         gsl_matrix_float_free(replica_v_samples[m]);
+         gsl_matrix_float_free(replica_v_exps[m]);
+         gsl_matrix_float_free(replica_h_samples[m]);
+         gsl_matrix_float_free(replica_h_exps[m]);
+         gsl_matrix_float_free(scratch[m]);
+         gsl_vector_float_free(energies[m]);
+      }
+      replica_v_samples.clear(); replica_v_exps.clear(); replica_h_samples.clear(); replica_h_exps.clear();
+      scratch.clear(); energies.clear();
+      gsl_block_float_free(pool);
    }
    
+   int v_size = visible->nodenum*particles, h_size = hidden->nodenum*particles;
+   int replica_size = 2*(v_size + h_size);
+   pool = gsl_block_float_alloc(replicas*replica_size);
+   
+   for (int m = 0; m < replicas; ++m) {
+      int offset = m*replica_size;
+      replica_v_samples.push_back(gsl_matrix_float_alloc_from_block(pool, offset, visible->nodenum, particles, particles));
+      replica_v_exps.push_back(gsl_matrix_float_alloc_from_block(pool, offset + v_size, visible->nodenum, particles, particles));
+      replica_h_samples.push_back(gsl_matrix_float_alloc_from_block(pool, offset + 2*v_size, hidden->nodenum, particles, particles));
+      replica_h_exps.push_back(gsl_matrix_float_alloc_from_block(pool, offset + 2*v_size + h_size, hidden->nodenum, particles, particles));
+      scratch.push_back(context->alloc_matrix(hidden->nodenum, particles));
+      energies.push_back(gsl_vector_float_alloc(particles));
+      
+      for (int p = 0; p < particles; ++p)
+         for (int i = 0; i < visible->nodenum; ++i)
+            gsl_matrix_float_set(replica_v_samples[m], i, p, gsl_matrix_float_get(visible->samples, i, p%visible->batchsize));
+      
+      gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, connection->weights, replica_v_samples[m], 0, replica_h_exps[m]);
+      hidden->fused_activation(replica_h_exps[m], replica_h_exps[m], replica_h_samples[m], rngs[m], betas[m]);
+   }
+   
+   // The beta = 1 replica is the persistent pool as far as getStats is concerned.
+   v_samples = replica_v_samples[0];
+   v_exps = replica_v_exps[0];
+   h_samples = replica_h_samples[0];
+   h_exps = replica_h_exps[0];
+   pool_owner = rbm;
+}
+
+// E(v,h) = -h.Wv + the layers' own terms, per particle.
+void Parallel_Tempering::get_energies(Connection *connection, int m){
+   gsl_vector_float *energy = energies[m];
+   gsl_matrix_float *hWv = scratch[m];
+   
+   gsl_vector_float_set_zero(energy);
+   connection->from->unit_energy(replica_v_samples[m], energy);
+   connection->to->unit_energy(replica_h_samples[m], energy);
+   
+   gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1, connection->weights, replica_v_samples[m], 0, hWv);
+   gsl_matrix_float_mul_elements(hWv, replica_h_samples[m]);
+   for (int i = 0; i < hWv->size1; ++i) {
+      float *row = hWv->data + i*hWv->tda;
+      for (int p = 0; p < particles; ++p) energy->data[p*energy->stride] -= row[p];
+   }
+}
+
+void Parallel_Tempering::swap_particle(int m, int p){
+   gsl_matrix_float *lower[] = {replica_v_samples[m], replica_v_exps[m], replica_h_samples[m], replica_h_exps[m]};
+   gsl_matrix_float *upper[] = {replica_v_samples[m+1], replica_v_exps[m+1], replica_h_samples[m+1], replica_h_exps[m+1]};
+   for (int n = 0; n < 4; ++n)
+      for (int i = 0; i < lower[n]->size1; ++i)
+         std::swap(lower[n]->data[i*lower[n]->tda + p], upper[n]->data[i*upper[n]->tda + p]);
+   std::swap(energies[m]->data[p*energies[m]->stride], energies[m+1]->data[p*energies[m+1]->stride]);
+}
+
+// Alternates between the even and odd neighbour pairs so that no replica is in two swaps at once.
+void Parallel_Tempering::swap_replicas(int parity){
+   for (int m = parity; m + 1 < replicas; m += 2) {
+      float dbeta = betas[m] - betas[m+1];
+      for (int p = 0; p < particles; ++p) {
+         float delta = dbeta*(gsl_vector_float_get(energies[m], p) - gsl_vector_float_get(energies[m+1], p));
+         ++attempts[m];
+         if (delta >= 0 || gsl_rng_uniform(context->rng) < expf(delta)) {
+            swap_particle(m, p);
+            ++accepts[m];
+         }
+      }
+      gsl_vector_float_set(acceptance, m, (float)accepts[m]/(float)attempts[m]);
+   }
+}
+
+void Parallel_Tempering::advance_chains(Connection *connection){
+   for (int g = 0; g < k; ++g) {
+      threads->run(replicas, [&](int m, int worker){
+         connection->gibbs_sweep(replica_v_samples[m], replica_v_exps[m], replica_h_samples[m], replica_h_exps[m], rngs[m], betas[m]);
+         get_energies(connection, m);
+      });
+      swap_replicas((updates*k + g)%2);
+   }
+   
+   ++updates;
+   if (updates%100 == 0) {
+      report();
+      reset_acceptance();
+   }
+}
+
+// Every replica's chains and rng, and the update count the swap parity comes from.
+void Parallel_Tempering::checkpoint_state(RBM *rbm, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters){
+   if (rbm->edges.size() != 1) return;
+   if (pool_owner != rbm) init_pool(rbm);
+   for (int m = 0; m < replicas; ++m) {
+      matrices.push_back(replica_v_samples[m]);
+      matrices.push_back(replica_v_exps[m]);
+      matrices.push_back(replica_h_samples[m]);
+      matrices.push_back(replica_h_exps[m]);
+      streams.push_back(rngs[m]);
+   }
+   counters.push_back(&updates);
+}
+
+void Parallel_Tempering::report(){
+   std::cout << "Swap acceptance (beta): ";
+   for (int m = 0; m + 1 < replicas; ++m)
+      std::cout << gsl_vector_float_get(acceptance, m) << "(" << betas[m] << "-" << betas[m+1] << ") ";
+   std::cout << std::endl;
+}
+
+void Parallel_Tempering::reset_acceptance(){
+   attempts.assign(replicas - 1, 0);
+   accepts.assign(replicas - 1, 0);
 }
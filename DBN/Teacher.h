@@ -10,20 +10,26 @@
 #define __DBN__Teacher__
 
 #include "Types.h"
+#include "Context.h"
 
 // This class keeps tracks of statistics and impliments teaching to various components.
 
 class RBM;
 class Monitor;
+class Connection;
+class Thread_Pool;
+class Checkpointer;
 
 class Teacher{
 public:
    bool           learning;
    Monitor        *monitor;
    float          learning_multiplier;
+   Checkpointer   *checkpointer;    // Snapshots and resumes training if set.
+   Context        *context;         // Seeds the teacher's own rngs.
    
    ~Teacher(){}
-   Teacher(){}
+   Teacher(Context *c = NULL) : checkpointer(NULL), context(c == NULL ? Context::default_context() : c) {}
    virtual void teachRBM(RBM* rbm) = 0;
    void multiply_rate();
    void divide_rate();
@@ -43,8 +49,69 @@ public:
    ContrastiveDivergence(){}
    ContrastiveDivergence(float momentum, int k, int batchsize, int epochs);
    
-   void getStats(RBM*);
+   virtual void getStats(RBM*);
+   virtual int next_batch(RBM*);
+   virtual void train_batch(RBM*);
    void teachRBM(RBM* rbm);
+   
+   // What a checkpoint needs besides the model to pick this teacher up exactly: chains, worker rngs and
+   // counters.  Sets up the teacher's buffers for rbm first, so the same list is used to save and restore.
+   virtual void checkpoint_state(RBM*, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters){}
+};
+
+// Persistent contrastive divergence.  The negative phase doesn't restart from the data: a pool of fantasy
+// particles (visible and hidden states, back to back in one block) is kept between updates and advanced
+// k fused Gibbs sweeps each time.  The pool size is independent of the batch size.  Only works on single
+// connection RBMs, anything else falls back to plain CD.
+class Persistent_CD : public ContrastiveDivergence {
+public:
+   int                     particles;
+   RBM                     *pool_owner;
+   
+   gsl_block_float         *pool;
+   gsl_matrix_float        *v_samples, *v_exps, *h_samples, *h_exps;
+   
+   ~Persistent_CD(){}
+   Persistent_CD(float momentum, int k, int batchsize, int epochs, int particles);
+   
+   virtual void init_pool(RBM*);
+   virtual void advance_chains(Connection*);
+   void getStats(RBM*);
+   void checkpoint_state(RBM*, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters);
+};
+
+// Parallel tempering on top of the persistent pool.  There are replicas copies of the particles, each run at
+// its own inverse temperature (geometric from 1 down to min_beta) with its own rng, one sweep per replica on
+// the thread pool.  After every sweep, neighbouring temperatures try to swap states, particle by particle,
+// with the usual Metropolis test on the joint energies.  The beta = 1 replica is the one the negative stats
+// come from.  acceptance holds the swap rate between replica i and i+1 since the last reset.
+class Parallel_Tempering : public Persistent_CD {
+public:
+   int                              replicas;
+   std::vector<float>               betas;
+   
+   std::vector<gsl_matrix_float*>   replica_v_samples, replica_v_exps, replica_h_samples, replica_h_exps;
+   std::vector<gsl_matrix_float*>   scratch;
+   std::vector<gsl_vector_float*>   energies;
+   std::vector<gsl_rng*>            rngs;
+   
+   std::vector<long>                attempts, accepts;
+   gsl_vector_float                 *acceptance;
+   int                              updates;
+   
+   Thread_Pool                      *threads;
+   
+   ~Parallel_Tempering(){}
+   Parallel_Tempering(float momentum, int k, int batchsize, int epochs, int particles, int replicas, float min_beta = 0.1, Thread_Pool *threads = NULL);
+   
+   void init_pool(RBM*);
+   void advance_chains(Connection*);
+   void get_energies(Connection*, int replica);
+   void swap_replicas(int parity);
+   void swap_particle(int replica, int particle);
+   void report();
+   void reset_acceptance();
+   void checkpoint_state(RBM*, std::vector<gsl_matrix_float*> &matrices, std::vector<gsl_rng*> &streams, std::vector<int*> &counters);
 };
 
 class Learner{
@@ -0,0 +1,54 @@
+//
+//  Threads.cpp
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#include "Threads.h"
+
+Thread_Pool::Thread_Pool(int threads) : task_count(0), busy(0), generation(0), stopping(false) {
+   if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+   next_task = 0;
+   for (int t = 0; t < threads; ++t) workers.push_back(std::thread(&Thread_Pool::work, this, t));
+}
+
+Thread_Pool::~Thread_Pool(){
+   {
+      std::unique_lock<std::mutex> guard(lock);
+      stopping = true;
+   }
+   start.notify_all();
+   for (auto &worker:workers) worker.join();
+}
+
+void Thread_Pool::run(int tasks, job_t job){
+   if (tasks <= 0) return;
+   std::unique_lock<std::mutex> guard(lock);
+   current_job = job;
+   task_count = tasks;
+   next_task = 0;
+   busy = (int)workers.size();
+   ++generation;
+   start.notify_all();
+   done.wait(guard, [this]{return busy == 0;});
+   current_job = job_t();
+}
+
+void Thread_Pool::work(int worker){
+   unsigned long seen = 0;
+   while (1) {
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         start.wait(guard, [&]{return stopping || generation != seen;});
+         if (stopping) return;
+         seen = generation;
+      }
+      
+      for (int task = next_task++; task < task_count; task = next_task++) current_job(task, worker);
+      
+      std::unique_lock<std::mutex> guard(lock);
+      if (--busy == 0) done.notify_one();
+   }
+}
@@ -0,0 +1,47 @@
+//
+//  Threads.h
+//  DBN
+//
+//  Created by Devon Hjelm on 10/18/26.
+//
+//
+
+#ifndef __DBN__Threads__
+#define __DBN__Threads__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// A fixed set of worker threads that get handed jobs split into tasks.  run blocks until every task is
+// done, so callers can treat it like a parallel for loop.  Tasks are handed out dynamically, but each one
+// gets its task number, so work that has to be reproducible should depend on that and not on the worker.
+class Thread_Pool {
+public:
+   typedef std::function<void(int task, int worker)> job_t;
+   
+   Thread_Pool(int threads = 0);
+   ~Thread_Pool();
+   
+   int size() {return (int)workers.size();}
+   void run(int tasks, job_t job);
+   
+private:
+   std::vector<std::thread>   workers;
+   std::mutex                 lock;
+   std::condition_variable    start, done;
+   
+   job_t                      current_job;
+   int                        task_count;
+   std::atomic<int>           next_task;
+   int                        busy;
+   unsigned long              generation;
+   bool                       stopping;
+   
+   void work(int worker);
+};
+
+#endif /* defined(__DBN__Threads__) */
@@ -7,24 +7,233 @@
 //
 
 #include "Timecourses.h"
-#include "RBM.h"
-#include "Connections.h"
+#include "MLP.h"
 #include "Layers.h"
 #include "IO.h"
-/*
-void get_timecourses(RBM *rbm, Connection *connection, DataSet *data){
-   Layer *bot = (Layer*)connection->from;
-   Layer *top = (Layer*)connection->to;
-   bot->input_edge->train = data->extra;
-   rbm->init_data();
-   rbm->make_batch((int)data->extra->size1);
-   rbm->load_data(TRAIN);
+#include "Inference.h"
+#include "SupportFunctions.h"
+#include <H5Cpp.h>
+#include <sstream>
+
+Feature_Writer::Feature_Writer(const std::string& p, int d) : path(p), depth(d), h5file(NULL), ok(true), closing(false), closed(false) {
+   hdf5 = path.size() > 3 && path.compare(path.size() - 3, 3, ".h5") == 0;
+   worker = std::thread(&Feature_Writer::work, this);
+}
+
+Feature_Writer::~Feature_Writer(){
+   close();
+}
+
+int Feature_Writer::add(const std::string& name, int cols){
+   std::unique_lock<std::mutex> guard(lock);
+   Stream stream;
+   stream.name = name;
+   stream.cols = cols;
+   stream.rows = 0;
+   stream.in_flight = 0;
+   stream.file_handle = NULL;
+   stream.dataset = NULL;
+   streams.push_back(stream);
+   return (int)streams.size() - 1;
+}
+
+// Written chunks come back as spares, so after the first few nothing is allocated.  Only the last chunk of
+// a stream is usually a different size.
+gsl_matrix_float *Feature_Writer::buffer(int s, int rows){
+   std::unique_lock<std::mutex> guard(lock);
+   Stream& stream = streams[s];
+   written.wait(guard, [&]{return stream.in_flight < depth;});
+   ++stream.in_flight;
+   gsl_matrix_float *chunk = NULL;
+   if (!stream.spare.empty()) {
+      chunk = stream.spare.back();
+      stream.spare.pop_back();
+   }
+   guard.unlock();
    
+   if (chunk != NULL && chunk->size1 != rows) {
+      gsl_matrix_float_free(chunk);
+      chunk = NULL;
+   }
+   if (chunk == NULL) chunk = gsl_matrix_float_alloc(rows, stream.cols);
+   return chunk;
+}
+
+void Feature_Writer::push(int s, gsl_matrix_float *chunk){
+   {
+      std::unique_lock<std::mutex> guard(lock);
+      queue.push_back(std::make_pair(s, chunk));
+   }
+   queued.notify_one();
+}
+
+bool Feature_Writer::close(){
+   {
+      std::unique_lock<std::mutex> guard(lock);
+      if (closed) return ok;
+      closing = true;
+   }
+   queued.notify_one();
+   worker.join();
+   closed = true;
+   for (auto &stream:streams) {
+      for (auto chunk:stream.spare) gsl_matrix_float_free(chunk);
+      stream.spare.clear();
+   }
+   return ok;
+}
+
+// Files are opened with the first chunk.  A binary file gets a header with no rows, which finish fills in.
+bool Feature_Writer::write(Stream& stream, gsl_matrix_float *chunk){
+   int rows = (int)chunk->size1;
+   if (hdf5) {
+      using namespace H5;
+      try {
+         if (h5file == NULL) h5file = new H5File(path, H5F_ACC_TRUNC);
+         if (stream.dataset == NULL) {
+            hsize_t dims[2] = {0, (hsize_t)stream.cols};
+            hsize_t max_dims[2] = {H5S_UNLIMITED, (hsize_t)stream.cols};
+            hsize_t chunk_dims[2] = {(hsize_t)rows, (hsize_t)stream.cols};
+            DataSpace space(2, dims, max_dims);
+            DSetCreatPropList properties;
+            properties.setChunk(2, chunk_dims);
+            stream.dataset = new H5::DataSet(h5file->createDataSet(stream.name, PredType::NATIVE_FLOAT, space, properties));
+         }
+         hsize_t size[2] = {(hsize_t)(stream.rows + rows), (hsize_t)stream.cols};
+         stream.dataset->extend(size);
+         DataSpace filespace = stream.dataset->getSpace();
+         hsize_t offset[2] = {(hsize_t)stream.rows, 0};
+         hsize_t count[2] = {(hsize_t)rows, (hsize_t)stream.cols};
+         filespace.selectHyperslab(H5S_SELECT_SET, count, offset);
+         DataSpace memspace(2, count);
+         stream.dataset->write(chunk->data, PredType::NATIVE_FLOAT, memspace, filespace);
+      }
+      catch (Exception& e) {
+         std::cerr << "Could not write " << stream.name << " to " << path << ": " << e.getDetailMsg() << std::endl;
+         return false;
+      }
+   }
+   else {
+      if (stream.file_handle == NULL) {
+         std::string filename = path + stream.name + ".bin";
+         stream.file_handle = fopen(filename.c_str(), "wb");
+         if (stream.file_handle == NULL) {
+            std::cerr << "Could not open file: " << filename << std::endl;
+            return false;
+         }
+         uint32_t header[3] = {binary_matrix_magic, 0, (uint32_t)stream.cols};
+         if (fwrite(header, sizeof(uint32_t), 3, stream.file_handle) != 3) return false;
+      }
+      size_t count = (size_t)rows*stream.cols;
+      if (fwrite(chunk->data, sizeof(float), count, stream.file_handle) != count) {
+         std::cerr << "Could not write " << stream.name << " to " << path << std::endl;
+         return false;
+      }
+   }
+   stream.rows += rows;
+   return true;
+}
+
+bool Feature_Writer::finish(Stream& stream){
+   bool finished = true;
+   if (stream.file_handle != NULL) {
+      uint32_t rows = (uint32_t)stream.rows;
+      finished = fseek(stream.file_handle, sizeof(uint32_t), SEEK_SET) == 0 && fwrite(&rows, sizeof(rows), 1, stream.file_handle) == 1;
+      finished = (fclose(stream.file_handle) == 0) && finished;
+      stream.file_handle = NULL;
+   }
+   if (stream.dataset != NULL) {
+      delete stream.dataset;
+      stream.dataset = NULL;
+   }
+   if (stream.rows > 0) std::cout << "Wrote " << stream.rows << "x" << stream.cols << " " << stream.name << " to " << path << (hdf5 ? "" : stream.name + ".bin") << std::endl;
+   return finished;
+}
+
+// After the first failure chunks are still taken off the queue (and handed back), just not written, so
+// the producer never blocks on a writer that gave up.
+void Feature_Writer::work(){
+   std::unique_lock<std::mutex> guard(lock);
+   while (1) {
+      queued.wait(guard, [this]{return closing || !queue.empty();});
+      if (queue.empty()) break;
+      std::pair<int, gsl_matrix_float*> item = queue.front();
+      queue.pop_front();
+      Stream& stream = streams[item.first];
+      guard.unlock();
+      if (ok && !write(stream, item.second)) ok = false;
+      guard.lock();
+      stream.spare.push_back(item.second);
+      --stream.in_flight;
+      written.notify_all();
+   }
+   guard.unlock();
+   
+   for (auto &stream:streams) if (!finish(stream)) ok = false;
+   if (h5file != NULL) {
+      delete h5file;
+      h5file = NULL;
+   }
+}
+
+//------------------------------------------------------------------------------
+
+// The mean field activations of every level from the data up to top, one stream per level ("level1" is the
+// first layer above the data).  An Inference_Engine computes chunk rows at a time while the writer puts the
+// chunk before on disk, so the export is bound by whichever is slower.  Sets that can't be read straight
+// out of memory (quantized, or mapped with preprocessing) go through DataSet::read_rows a chunk at a time.
+// A training set streamed from a catalog is exported shard by shard, in order, as one stream per level.
+bool export_features(MLP *mlp, Layer *top, DataSet *data, Data_flag_t d_flag, const std::string& path, int chunk){
+   Input_t *in = (d_flag == TRAIN) ? data->train : (d_flag == TEST) ? data->test : data->extra;
+   if (in == NULL) {
+      std::cerr << "No " << ((d_flag == TRAIN) ? "training" : (d_flag == TEST) ? "test" : "timecourse") << " data in " << data->name << " to export" << std::endl;
+      return false;
+   }
    
-   rbm->sample_flag = NOSAMPLE;
-   rbm->prop(FORWARD);
+   Inference_Engine engine(mlp, top);
+   int levels = (int)engine.stages.size();
+   int cols = data->columns_of(in);
+   if (levels == 0 || engine.bottom->nodenum != cols) {
+      std::cerr << "Can't export " << cols << " columns of " << data->name << " through this path" << std::endl;
+      return false;
+   }
    
-   viz.viz = gsl_matrix_float_alloc(top->activations->size1, top->activations->size2);
-   gsl_matrix_float_memcpy(viz.viz, top->activations);
-   viz.plot();
-}*/
\ No newline at end of file
+   Feature_Writer writer(path);
+   for (int s = 0; s < levels; ++s) {
+      std::stringstream name;
+      name << "level" << s + 1;
+      writer.add(name.str(), engine.stages[s].layer->nodenum);
+   }
+   
+   int shards = (d_flag == TRAIN) ? data->shard_count() : 1, open = data->shard;
+   std::vector<gsl_matrix_float*> outputs(levels);
+   for (int sh = 0; sh < shards; ++sh) {
+      if (shards > 1 && sh != data->shard && !data->open_shard(sh)) continue;
+      if (shards > 1) in = data->train;
+      
+      int rows = (int)in->size1;
+      Input_t *staging = (data->direct(in) || rows == 0) ? NULL : gsl_matrix_float_alloc(std::min(chunk, rows), in->size2);
+      for (int start = 0; start < rows; start += chunk) {
+         int n = std::min(chunk, rows - start);
+         gsl_matrix_float_view block;
+         if (staging != NULL) {
+            data->read_rows(in, start, n, NULL, staging->data);
+            block = gsl_matrix_float_submatrix(staging, 0, 0, n, cols);
+         }
+         else block = gsl_matrix_float_submatrix(in, start, 0, n, cols);
+         
+         for (int s = 0; s < levels; ++s) outputs[s] = writer.buffer(s, n);
+         engine.extract_levels(&block.matrix, outputs);
+         for (int s = 0; s < levels; ++s) writer.push(s, outputs[s]);
+      }
+      if (staging != NULL) gsl_matrix_float_free(staging);
+   }
+   if (shards > 1 && data->shard != open) data->open_shard(open);
+   
+   return writer.close();
+}
+
+// Column k of each level is feature k's timecourse over the scans of the timecourse set.
+bool get_timecourses(MLP *mlp, Layer *top, DataSet *data, const std::string& path){
+   return export_features(mlp, top, data, TIMECOURSE, path);
+}
@@ -10,11 +10,71 @@
 #define __DBN__Timecourses__
 
 #include <iostream>
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Types.h"
 
-class RBM;
-class Connection;
+class MLP;
+class Layer;
 class DataSet;
+namespace H5 {
+   class H5File;
+   class DataSet;
+}
 
-void get_timecourses(RBM *rbm, Connection* connection, DataSet *data);
+/////////////////////////////////////
+// Feature export
+/////////////////////////////////////
+
+// Streams matrices to disk a chunk of rows at a time from a background thread, so whoever computes them
+// only waits when it gets depth chunks ahead of the disk.  Each stream is one matrix of rows x cols.  With
+// a path ending in .h5 they all go into one HDF5 file as chunked, extendible datasets named after the
+// streams; otherwise each is a binary matrix file path + name + ".bin" (save_gsl_matrix_binary's format,
+// so it can be loaded or mapped back).  Files are opened and written only on the writer thread.
+class Feature_Writer {
+public:
+   std::string                path;
+   bool                       hdf5;
+   
+   Feature_Writer(const std::string& path, int depth = 4);
+   ~Feature_Writer();
+   
+   int add(const std::string& name, int cols);          // Returns the stream number.  Only before the first push.
+   gsl_matrix_float *buffer(int stream, int rows);      // A chunk to fill, waits while depth are in flight.
+   void push(int stream, gsl_matrix_float *chunk);      // Queues a chunk from buffer to be written.
+   bool close();                                        // Writes what's queued and finishes the files.
+   
+private:
+   struct Stream {
+      std::string                      name;
+      int                              cols;
+      long                             rows;            // Written so far.
+      int                              in_flight;       // Handed out by buffer and not written yet.
+      std::vector<gsl_matrix_float*>   spare;
+      FILE                             *file_handle;
+      H5::DataSet                      *dataset;
+   };
+   
+   std::vector<Stream>        streams;
+   std::deque< std::pair<int, gsl_matrix_float*> > queue;
+   int                        depth;
+   H5::H5File                 *h5file;
+   bool                       ok, closing, closed;
+   
+   std::thread                worker;
+   std::mutex                 lock;
+   std::condition_variable    queued, written;
+   
+   bool write(Stream& stream, gsl_matrix_float *chunk);
+   bool finish(Stream& stream);
+   void work();
+};
+
+bool export_features(MLP *mlp, Layer *top, DataSet *data, Data_flag_t d_flag, const std::string& path, int chunk = 4096);
+bool get_timecourses(MLP *mlp, Layer *top, DataSet *data, const std::string& path);
 
 #endif /* defined(__DBN__Timecourses__) */
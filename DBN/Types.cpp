@@ -7,14 +7,3 @@
 //
 
 #include "Types.h"
-
-std::string path = "/home/pliz/soft/src/dev/tools/DBN-2.0/";
-
-gsl_rng * r;
-std::string MNISTpath = path + "MNISTdata/";
-std::string plotpath = path + "plots/";
-std::string fMRIpath = path + "fMRIdata";
-std::string SPMpath = path + "SPMdata/";
-std::string vertexPath = path + "Shaders/Vertex.c";
-std::string fragmentPath = path + "Shaders/Fragment.c";
-std::string fMRI_3D_path = path + "fMRIdata3D1/";
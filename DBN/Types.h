@@ -32,15 +32,6 @@
 #include <gsl/gsl_statistics.h>
 #define PI 3.1415
 
-extern std::string MNISTpath;
-extern std::string plotpath;
-extern std::string fMRIpath;
-extern std::string SPMpath;
-extern std::string vertexPath;
-extern std::string fragmentPath;
-extern std::string fMRI_3D_path;
-extern gsl_rng * r;
-
 typedef gsl_matrix_float   Input_t;
 
 typedef enum{BACKWARD, FORWARD} Direction_flag_t;
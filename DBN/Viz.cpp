@@ -20,8 +20,6 @@
 //BEGIN OPENGL stuff
 
 bool   _running;             //< true if the program is running, false if it is time to terminate
-Visualizer *the_viz;
-Monitor *the_monitor;
 
 //--------------------------------------------------------------
 
@@ -198,8 +196,8 @@ GLuint Visualizer::createShader(const std::string& source, GLenum shaderType)
  */
 GLuint Visualizer::createGLSLProgram()
 {
-   std::string vertexSource = readTextFile(vertexPath);
-   std::string fragmentSource = readTextFile(fragmentPath);
+   std::string vertexSource = readTextFile(context->vertexPath);
+   std::string fragmentSource = readTextFile(context->fragmentPath);
 
    
    _program = glCreateProgram();
@@ -463,6 +461,11 @@ void GLFWCALL resize(int width, int height)
  */
 void GLFWCALL keypress(int key, int state)
 {
+   Context *context = Context::gui;
+   if (context == NULL || context->monitor == NULL) return;
+   Visualizer *viz = context->viz;
+   Monitor *monitor = context->monitor;
+   
    if(state == GLFW_PRESS)
    {
       switch(key)
@@ -471,37 +474,37 @@ void GLFWCALL keypress(int key, int state)
             _running = false;
             break;
          case 'V' :
-            the_viz->toggle_on();
+            viz->toggle_on();
             break;
          case GLFW_KEY_SPACE :
-            the_viz->toggle_pause();
+            viz->toggle_pause();
             break;
          case 'L' :
-            the_monitor->send_stop_signal();
+            monitor->send_stop_signal();
             break;
          case '+' :
          case '=' :
-            the_monitor->teacher->multiply_rate();
+            monitor->teacher->multiply_rate();
             break;
          case '-' :
-            the_monitor->teacher->divide_rate();
+            monitor->teacher->divide_rate();
             break;
          case '0' :
-            the_monitor->teacher->learning_multiplier = 1;
+            monitor->teacher->learning_multiplier = 1;
             break;
          case '[' :
-            if (the_monitor->threshold > 0) the_monitor->threshold -=.1;
+            if (monitor->threshold > 0) monitor->threshold -=.1;
             break;
          case ']' :
-            if (the_monitor->threshold < 1) the_monitor->threshold +=.1;
+            if (monitor->threshold < 1) monitor->threshold +=.1;
             break;
          case '<' :
          case ',' :
-            the_monitor->move_down_stack();
+            monitor->move_down_stack();
             break;
          case '>' :
          case '.' :
-            the_monitor->move_up_stack();
+            monitor->move_up_stack();
             break;
       }
    }
@@ -36,14 +36,12 @@ class MNIST_Feature_Monitor;
 class MNIST_Layer_Monitor;
 class Teacher;
 class Visualizer;
+class Context;
 
 void GLFWCALL resize(int width, int height);
 void GLFWCALL keypress(int key, int state);
 int GLFWCALL close(void);
 
-extern Visualizer *the_viz;
-extern Monitor    *the_monitor;
-
 using std::vector;
 
 class Visualizer{
@@ -51,6 +49,7 @@ public:
    
    bool                    on;
    bool                    pause;
+   Context                 *context;            // For the shader paths
    
    std::vector<GLuint> _texID;
    std::vector<GLuint>  _lineVAO;   //< Vertex array object for line plots
@@ -75,7 +74,7 @@ public:
    std::vector<glm::vec2> _texCoords;//< Texture coordinates for the textured quad
    
    Visualizer(){}
-   Visualizer(int width, int height){
+   Visualizer(int width, int height, Context *context) : context(context) {
       open_window(width, height);
       pause = false;
    }
@@ -24,23 +24,20 @@ int main (int argc, const char * argv[])
    
    srand((unsigned)time(0));
    
-   long seed;
-   r = gsl_rng_alloc (gsl_rng_rand48);     // pick random number generator
-   seed = time (NULL) * getpid();
-   gsl_rng_set (r, seed);                  // set seed
+   Context *context = Context::default_context();   // rng seeded from time*pid, paths from the repo root
    
    //--------------
    //LOAD DATASET and INIT
    
-   DataSet *data1 = new DataSet;
+   DataSet *data1 = new DataSet(context);
 #if 1
    data1->load_single_3D_fMRI();
    
-   GaussianLayer *fMRI3D_layer = new GaussianLayer((int)data1->dims[3]);
+   GaussianLayer *fMRI3D_layer = new GaussianLayer((int)data1->dims[3], context);
    Input_Edge *fMRI3D_edge = new Input_Edge(data1, fMRI3D_layer);
    fMRI3D_layer->shapeInput(data1);
    
-   ReLULayer *hidden_layer = new ReLULayer(16);
+   ReLULayer *hidden_layer = new ReLULayer(16, context);
    Connection *connection = new Connection(fMRI3D_layer, hidden_layer);
    connection->learning_rate = 0.0000001;
    connection->decay = 0;
@@ -55,7 +52,7 @@ int main (int argc, const char * argv[])
    Single_3D_Data_Monitor *mon = new Single_3D_Data_Monitor(data1);
    cd->monitor = mon;
    
-   DBN *dbn = new DBN;
+   DBN *dbn = new DBN(context);
    dbn->add(fMRI3D_edge);
    dbn->add(connection);
    dbn->teacher = cd;